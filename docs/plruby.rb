@@ -9,7 +9,17 @@
 # system that enables the Ruby language to create functions and
 # trigger procedures.
 # 
-# Functions and triggers are singleton methods of the module PLtemp.
+# Functions and triggers are methods executed with self set to the
+# module PLtemp.
+# 
+# With ruby >= 2.3 the compiled bytecode of a function is saved, when
+# the function is created or first called, in the directory
+# <em>plruby_iseq</em> of the database cluster and is loaded from there
+# by the other backends. There is one file for each function, replaced by
+# a new version of the function and removed when the function or its
+# database is dropped. The directory is only a cache, it can be deleted
+# at any time (e.g. <em>rm -rf $PGDATA/plruby_iseq</em>), the files are
+# written again when needed.
 # 
 # = WARNING
 # 
@@ -259,6 +269,16 @@ end
 # The function must call <em>yield</em> to return rows or return a String
 # which must be a valid SELECT statement
 # 
+# A row is an Array with a value for each column, or a Hash where the
+# keys are column names (String or Symbol) : a missing column is NULL.
+# This is also true for a function returning a composite type
+# 
+# When the caller can't take a materialized set (a SETOF function called
+# in the target list) the function runs, with ruby >= 1.9 and PostgreSQL
+# >= 9.2, in a Fiber : each <em>yield</em> gives one row to the executor
+# and the function stops when no more rows are read (for example with
+# LIMIT). Otherwise the rows go to a tuplestore
+# 
 # For example to concatenate 2 rows create the function
 # 
 #    plruby_test=# CREATE FUNCTION tu(varchar) RETURNS setof record
@@ -656,6 +676,41 @@ module PLRuby::PL
    def  context=
    end
    # 
+   #Return the number of plans kept in the plan cache (0 disables it).
+   #<em>prepare</em> and <em>exec</em> with values take their saved plan
+   #from this cache, keyed by the query and the types of the arguments,
+   #and the least recently used plan is released when the cache is full.
+   #
+   def  plan_cache_size
+   end
+   # 
+   #Set the number of plans kept in the plan cache
+   #
+   def  plan_cache_size=(size)
+   end
+   # 
+   #Return a hash with the keys "size", "max", "hits", "misses" and
+   #"evictions" of the plan cache
+   #
+   def  plan_cache_stats
+   end
+   # 
+   #Release all the plans of the cache
+   #
+   def  plan_cache_clear
+   end
+   # 
+   #Give an Array of rows to a function returning SET, like a +yield+
+   #for each row but with only one call
+   #
+   def  emit_rows(rows)
+   end
+   # 
+   #Same as emit_rows
+   #
+   def  yield_batch(rows)
+   end
+   # 
    # 
    #Duplicates all occurences of single quote and backslash
    #characters. It should be used when variables are used in the query
@@ -690,6 +745,21 @@ module PLRuby::PL
    #Call parser/planner/optimizer/executor for query. The optional
    #<em>count</em> value tells spi_exec the maximum number of rows to be
    #processed by the query.
+   #
+   #With PostgreSQL >= 8.4, the second argument (or the option
+   #"values") can be an Array with the values of $1, $2, ... in the
+   #query. They are not rendered in the query : the query is parsed once
+   #with their types. The option "types" gives the type name (or oid) of
+   #each value, otherwise the type is int8, numeric, float8 or bool
+   #according to the class of the value. With PostgreSQL >= 9.0 the type
+   #of nil or of a String is inferred from where the parameter is used,
+   #as for a query sent by a client (unknown when it can't be inferred);
+   #with an older server nil is text and the type of a String must be
+   #given. The type of any other object must be given in "types".
+   #
+   #   PL.exec("select * from T_pkey1 where skey1 = $1", [12],
+   #           "types" => ["int4"])
+   #   PL.exec("select * from T_pkey1 where skey1 = $1", ["12"])
    #    
    #* SELECT
    #If the query is a SELECT statement, an array is return (if count is
@@ -703,6 +773,13 @@ module PLRuby::PL
    #* "hash" return for each column an hash with the keys 
    #{"name", "value", "type", "len", "typeid"}
    #* "value" return all values
+   #* "symbol_hash" return an hash where the key is the column
+   #name as a Symbol
+   #* "columns" return one hash where the key is the column name
+   #and the value an array with the values of this column
+   #* "packed_columns" like "columns", but the int2, int4, int8,
+   #float4 and float8 columns without NULL are given as a binary
+   #string in native byte order (use String#unpack)
    #
    #For example this procedure display all rows in the table pg_table.
    #    
@@ -720,6 +797,11 @@ module PLRuby::PL
    #    
    #A block can be specified, in this case a call to yield() will be
    #made.
+   #
+   #With a block, a SELECT is read through a cursor (PostgreSQL >= 8.1)
+   #: the rows are fetched 16 at first, then by blocks twice larger
+   #up to 1024 (or the option "block" => n), and the whole result
+   #is never in memory.
    #    
    #If count is specified with the value 1, only the first row (or
    #FALSE if it fail) is returned as a hash. Here a little example :
@@ -852,6 +934,9 @@ class PL::Plan
    #* "array" return an array with the element ["name", "value", "type", "len", "typeid"]
    #* "hash" return an hash with the keys {"name", "value", "type", "len", "typeid"}
    #* "value" return an array with all values
+   #* "symbol_hash" return an hash where the key is the column name as a Symbol
+   #* "columns" return an hash where the key is the column name and the value an array with its values
+   #* "packed_columns" like "columns" with numeric columns as a binary string
    #
    #Here's an example for a PLRuby function using a prepared plan : 
    #
@@ -882,6 +967,9 @@ class PL::Plan
    #* "array" return an array with the element ["name", "value", "type", "len", "typeid"]
    #*  "hash" return an hash with the keys {"name", "value", "type", "len", "typeid"}
    #* "value" return an array with all values
+   #* "symbol_hash" return an hash where the key is the column name as a Symbol
+   #* "columns" return an hash where the key is the column name and the value an array with its values
+   #* "packed_columns" like "columns" with numeric columns as a binary string
    #
    #If there was a typelist given to <em>PL::Plan::new</em>, an array
    #of <em>values</em> of exactly the same length must be given to
@@ -941,6 +1029,19 @@ class PL::Plan
    def  fetch("values" => values, "count" => count, "output" => type) { ... }
    end
    # 
+   #Execute the plan for each Array of arguments in <em>rows</em> and
+   #return the total number of rows processed. The arguments are converted
+   #in the same buffers and the results are not read. On error, the
+   #message (or the CONTEXT of a PostgreSQL error) gives the index of the
+   #row
+   #
+   #   plan = PL::Plan.new("insert into T_pkey1 values ($1, $2, $3)",
+   #                       ["int4", "varchar", "varchar"])
+   #   plan.exec_batch([[1, "a", "b"], [2, "c", "d"]])
+   #
+   def  exec_batch(rows)
+   end
+   # 
    #
    #Release a query plan
    #
@@ -1012,6 +1113,114 @@ class PLRuby::PL::Transaction
    def commit
    end
 end
+
+#
+# A packed vector of int4, int8, float4 or float8
+#
+# Returned by a function with the same array type, it is copied as is
+# in the array
+#
+class PLRuby::PL::Vector
+   class << self
+      # Vector with a copy of the argument <em>n</em> of the function,
+      # which must be an array without NULL. Return nil if the argument
+      # is NULL
+      def arg(n)
+      end
+   end
+
+   # <em>type</em> is "int4", "int8", "float4" or "float8",
+   # <em>values</em> is an Array or a string as given by the output
+   # "packed_columns"
+   def initialize(type, values)
+   end
+
+   # return the element at <em>indice</em>
+   def [](indice)
+   end
+
+   # number of elements
+   def size
+   end
+
+   # type of the elements
+   def type
+   end
+
+   # return an Array
+   def to_a
+   end
+
+   # return the packed string
+   def to_s
+   end
+
+   # sum of the elements, a Bignum when it doesn't fit in an int8
+   def sum
+   end
+
+   # mean of the elements
+   def mean
+   end
+
+   # smallest element
+   def min
+   end
+
+   # greatest element
+   def max
+   end
+
+   # dot product with a vector of the same type and size
+   def dot(other)
+   end
+
+   # Array with the number of elements in each of the <em>bins</em>
+   # intervals between <em>min</em> and <em>max</em>
+   def histogram(bins, min = self.min, max = self.max)
+   end
+end
+#
+# A read-only view on an array argument : the elements are converted
+# when they are read
+#
+class PLRuby::PL::ArrayView
+   include Enumerable
+
+   class << self
+      # view on the argument <em>n</em> of the function, nil if it is NULL
+      def arg(n)
+      end
+   end
+
+   # the element at the flat position <em>indice</em>, or at the position
+   # given with one index (starting at 0) for each dimension. NULL
+   # elements are nil
+   def [](*indices)
+   end
+
+   # return true if the element is NULL
+   def null?(*indices)
+   end
+
+   # the dimensions
+   def dims
+   end
+
+   # the number of elements
+   def size
+   end
+
+   # iterate over all elements
+   def each
+      yield elem
+   end
+
+   # return a (nested) Array
+   def to_a
+   end
+end
+
 #
 # The class PLRuby::BitString implement the PostgreSQL type <em>bit</em>
 # and <em>bit varying</em>
@@ -28,6 +28,21 @@ ensure
    File.unlink("a.rb")
 end
       
+def check_require(safe = 12)
+   File.open("b.rb", "w") {|f| f.puts "class B; end" }
+   Thread.new do
+      begin
+         $SAFE = safe
+         require "./b.rb"
+         true
+      rescue Exception
+         false
+      end
+   end.value
+ensure
+   File.unlink("b.rb")
+end
+      
 def check_md
    Marshal.load(Marshal.dump(AX.new))
    false
@@ -35,6 +50,18 @@ rescue
    true
 end
 
+def check_bind_any
+   Module.new { def a; end }.instance_method(:a).bind(Object.new)
+   true
+rescue
+   false
+end
+
+def check_iseq_binary
+   defined?(RubyVM::InstructionSequence) &&
+      RubyVM::InstructionSequence.respond_to?(:load_from_binary_extra_data)
+end
+
 def create_lang(version = 74, suffix = '', safe = 0)
    language, opaque = 'C', 'language_handler'
    opaque = "opaque" if version == 72
@@ -113,6 +140,14 @@ if timeout = with_config("timeout")
    end
 end
 
+if plan_cache = with_config("plan-cache")
+   plan_cache = Integer(plan_cache)
+   if plan_cache < 0
+      raise "Invalid value for plan-cache #{plan_cache}"
+   end
+   $CFLAGS += " -DPLRUBY_PLAN_CACHE=#{plan_cache}"
+end
+
 if ! have_header("catalog/pg_proc.h")
     raise  "Some include file are missing (see README for the installation)"
 end
@@ -141,6 +176,16 @@ if "aa".respond_to?(:initialize_copy, true)
 end
 
 have_func("rb_block_call")
+have_func("rb_method_call")
+have_func("rb_thread_atfork")
+have_func("rb_str_to_interned_str")
+have_func("rb_fiber_new")
+if check_bind_any
+   $CFLAGS += " -DRUBY_CAN_BIND_ANY"
+   if enable_config("iseq-cache", true) && check_iseq_binary
+      $CFLAGS += " -DPLRUBY_ISEQ_CACHE"
+   end
+end
 have_header("ruby/st.h")
 have_header("st.h")
 
@@ -165,6 +210,9 @@ if enable_conversion = enable_config("conversion", true)
    if check_autoload(safe.to_i)
       $CFLAGS += " -DRUBY_CAN_USE_AUTOLOAD"
    end
+   if check_require(safe.to_i)
+      $CFLAGS += " -DRUBY_CAN_USE_LAZY_REQUIRE"
+   end
    if check_md
       $CFLAGS += " -DRUBY_CAN_USE_MARSHAL_DUMP"
    end
@@ -214,7 +262,7 @@ begin
              end
       find_library(libs, "ruby_init", Config::expand(CONFIG["archdir"].dup))
    end
-   $objs = ["plruby.o", "plplan.o", "plpl.o", "pltrans.o"] unless $objs
+   $objs = ["plruby.o", "plplan.o", "plpl.o", "pltrans.o", "plvector.o", "plarray.o"] unless $objs
    create_makefile("plruby#{suffix}")
 ensure
    Dir.chdir("..")
@@ -1,25 +1,20 @@
-{
-    extern void plruby_require(char *);
+    { OIDOID, "plruby/plruby_basic", NULL, &rb_cFixnum },
+    { INT2OID, "plruby/plruby_basic", NULL, &rb_cFixnum },
+    { INT4OID, "plruby/plruby_basic", NULL, &rb_cFixnum },
+    { INT8OID, "plruby/plruby_basic", NULL, &rb_cFixnum },
 
-    plruby_require("plruby/plruby_basic");
-    rb_hash_aset(plruby_classes, INT2NUM(OIDOID), rb_cFixnum);
-    rb_hash_aset(plruby_classes, INT2NUM(INT2OID), rb_cFixnum);
-    rb_hash_aset(plruby_classes, INT2NUM(INT4OID), rb_cFixnum);
-    rb_hash_aset(plruby_classes, INT2NUM(INT8OID), rb_cFixnum);
+    { FLOAT4OID, "plruby/plruby_basic", NULL, &rb_cFloat },
+    { FLOAT8OID, "plruby/plruby_basic", NULL, &rb_cFloat },
+    { CASHOID, "plruby/plruby_basic", NULL, &rb_cFloat },
+    { NUMERICOID, "plruby/plruby_basic", NULL, &rb_cFloat },
 
-    rb_hash_aset(plruby_classes, INT2NUM(FLOAT4OID), rb_cFloat);
-    rb_hash_aset(plruby_classes, INT2NUM(FLOAT8OID), rb_cFloat);
-    rb_hash_aset(plruby_classes, INT2NUM(CASHOID), rb_cFloat);
-    rb_hash_aset(plruby_classes, INT2NUM(NUMERICOID), rb_cFloat);
+    { TIMESTAMPOID, "plruby/plruby_basic", NULL, &rb_cTime },
+    { TIMESTAMPTZOID, "plruby/plruby_basic", NULL, &rb_cTime },
+    { ABSTIMEOID, "plruby/plruby_basic", NULL, &rb_cTime },
+    { DATEOID, "plruby/plruby_basic", NULL, &rb_cTime },
+    { RELTIMEOID, "plruby/plruby_basic", NULL, &rb_cTime },
+    { INTERVALOID, "plruby/plruby_basic", NULL, &rb_cTime },
+    { TIMETZOID, "plruby/plruby_basic", NULL, &rb_cTime },
+    { TIMEOID, "plruby/plruby_basic", NULL, &rb_cTime },
 
-    rb_hash_aset(plruby_classes, INT2NUM(TIMESTAMPOID), rb_cTime);
-    rb_hash_aset(plruby_classes, INT2NUM(TIMESTAMPTZOID), rb_cTime);
-    rb_hash_aset(plruby_classes, INT2NUM(ABSTIMEOID), rb_cTime);
-    rb_hash_aset(plruby_classes, INT2NUM(DATEOID), rb_cTime);
-    rb_hash_aset(plruby_classes, INT2NUM(RELTIMEOID), rb_cTime);
-    rb_hash_aset(plruby_classes, INT2NUM(INTERVALOID), rb_cTime);
-    rb_hash_aset(plruby_classes, INT2NUM(TIMETZOID), rb_cTime);
-    rb_hash_aset(plruby_classes, INT2NUM(TIMEOID), rb_cTime);
-
-    rb_hash_aset(plruby_classes, ULONG2NUM(BYTEAOID), rb_cString);
-}
+    { BYTEAOID, "plruby/plruby_basic", NULL, &rb_cString },
@@ -0,0 +1,303 @@
+#include "plruby.h"
+
+/*
+ * PL::ArrayView : read-only access to an array argument, the elements
+ * are converted only when they are read
+ */
+
+static VALUE pl_ePLruby, pl_cArrayView;
+
+struct pl_array_view {
+    ArrayType *array;
+    int ndim, *dims, nitems;
+    bits8 *bitmap;
+    Oid elemtype;
+    int16 typlen;
+    bool typbyval;
+    char typalign;
+    int stride;
+    FmgrInfo func;
+    plruby_arg_conv conv;
+    int cur_idx;
+    char *cur_ptr;
+};
+
+static void
+pl_view_mark(struct pl_array_view *view)
+{
+}
+
+static void
+pl_view_free(struct pl_array_view *view)
+{
+    xfree(view->array);
+    xfree(view);
+}
+
+#define GetView(obj_, view_) do {                                       \
+    if (TYPE(obj_) != T_DATA ||                                         \
+        RDATA(obj_)->dmark != (RUBY_DATA_FUNC)pl_view_mark) {           \
+        rb_raise(rb_eArgError, "expected a PL::ArrayView");             \
+    }                                                                   \
+    Data_Get_Struct(obj_, struct pl_array_view, view_);                 \
+} while (0)
+
+#define PL_VIEW_NOTNULL(view_, i_)                                      \
+    (!(view_)->bitmap || ((view_)->bitmap[(i_) / 8] & (1 << ((i_) % 8))))
+
+VALUE
+plruby_array_view_new(Datum value)
+{
+    struct pl_array_view *view;
+    ArrayType *array;
+    HeapTuple typeTup;
+    Form_pg_type fpgt;
+    VALUE res;
+
+    res = Data_Make_Struct(pl_cArrayView, struct pl_array_view, pl_view_mark,
+                           pl_view_free, view);
+    PLRUBY_BEGIN_PROTECT(1);
+    array = DatumGetArrayTypeP(value);
+    view->elemtype = ARR_ELEMTYPE(array);
+    typeTup = SearchSysCache(TYPEOID, OidGD(view->elemtype), 0, 0, 0);
+    if (!HeapTupleIsValid(typeTup)) {
+        elog(ERROR, "cache lookup failed for type %u", view->elemtype);
+    }
+    fpgt = (Form_pg_type) GETSTRUCT(typeTup);
+    view->typlen = fpgt->typlen;
+    view->typbyval = fpgt->typbyval;
+    view->typalign = fpgt->typalign;
+    fmgr_info(fpgt->typoutput, &view->func);
+    ReleaseSysCache(typeTup);
+    PLRUBY_END_PROTECT;
+
+    view->array = (ArrayType *)xmalloc(VARSIZE(array));
+    memcpy(view->array, array, VARSIZE(array));
+    view->ndim = ARR_NDIM(view->array);
+    view->dims = ARR_DIMS(view->array);
+    view->nitems = ArrayGetNItems(view->ndim, view->dims);
+    view->bitmap = PL_ARR_NULLBITMAP(view->array);
+    if (view->typlen > 0) {
+#ifdef att_align_nominal
+        view->stride = att_align_nominal(view->typlen, view->typalign);
+#else
+        view->stride = att_align(view->typlen, view->typalign);
+#endif
+    }
+    view->conv = plruby_arg_converter(view->elemtype);
+    view->cur_ptr = ARR_DATA_PTR(view->array);
+    OBJ_TAINT(res);
+    return res;
+}
+
+/* data of the element i, NULL for a NULL element */
+static char *
+pl_view_locate(struct pl_array_view *view, int i)
+{
+    char *p;
+
+    if (!PL_VIEW_NOTNULL(view, i)) {
+        return NULL;
+    }
+    if (view->stride && !view->bitmap) {
+        return ARR_DATA_PTR(view->array) + i * view->stride;
+    }
+    if (i < view->cur_idx) {
+        view->cur_idx = 0;
+        view->cur_ptr = ARR_DATA_PTR(view->array);
+    }
+    p = view->cur_ptr;
+    for (; view->cur_idx < i; view->cur_idx++) {
+        if (!PL_VIEW_NOTNULL(view, view->cur_idx)) {
+            continue;
+        }
+        if (view->stride) {
+            p += view->stride;
+            continue;
+        }
+#ifdef att_addlength_pointer
+        p = att_addlength_pointer(p, view->typlen, p);
+        p = (char *) att_align_nominal(p, view->typalign);
+#else
+        p = att_addlength(p, view->typlen, PointerGD(p));
+        p = (char *) att_align(p, view->typalign);
+#endif
+    }
+    view->cur_ptr = p;
+    return p;
+}
+
+static VALUE
+pl_view_elem(struct pl_array_view *view, int i)
+{
+    Datum value;
+    char *p;
+
+    if (!(p = pl_view_locate(view, i))) {
+        return Qnil;
+    }
+    value = fetch_att(p, view->typbyval, view->typlen);
+    if (view->conv) {
+        return view->conv(value);
+    }
+    return plruby_convert_arg(value, view->elemtype, &view->func, (Oid)0, -1);
+}
+
+/* flat position of the element given by one index, or one per dimension */
+static int
+pl_view_index(struct pl_array_view *view, int argc, VALUE *argv)
+{
+    int i, j, k;
+
+    if (argc == 1) {
+        i = NUM2INT(argv[0]);
+        if (i < 0) {
+            i += view->nitems;
+        }
+        return (i < 0 || i >= view->nitems) ? -1 : i;
+    }
+    if (argc == 0 || argc != view->ndim) {
+        rb_raise(rb_eArgError, "wrong number of indices (%d for 1 or %d)",
+                 argc, view->ndim);
+    }
+    for (i = j = 0; j < argc; j++) {
+        k = NUM2INT(argv[j]);
+        if (k < 0 || k >= view->dims[j]) {
+            return -1;
+        }
+        i = i * view->dims[j] + k;
+    }
+    return (i < view->nitems) ? i : -1;
+}
+
+/* a view on the array argument at position n */
+static VALUE
+pl_view_s_arg(VALUE obj, VALUE a)
+{
+    Datum value;
+    Oid typoid;
+
+    if (!plruby_call_arg(NUM2INT(a), &value, &typoid)) {
+        return Qnil;
+    }
+    return plruby_array_view_new(value);
+}
+
+static VALUE
+pl_view_aref(int argc, VALUE *argv, VALUE obj)
+{
+    struct pl_array_view *view;
+    int i;
+
+    GetView(obj, view);
+    if ((i = pl_view_index(view, argc, argv)) < 0) {
+        return Qnil;
+    }
+    return pl_view_elem(view, i);
+}
+
+static VALUE
+pl_view_null_p(int argc, VALUE *argv, VALUE obj)
+{
+    struct pl_array_view *view;
+    int i;
+
+    GetView(obj, view);
+    if ((i = pl_view_index(view, argc, argv)) < 0) {
+        return Qnil;
+    }
+    return PL_VIEW_NOTNULL(view, i)?Qfalse:Qtrue;
+}
+
+static VALUE
+pl_view_size(VALUE obj)
+{
+    struct pl_array_view *view;
+
+    GetView(obj, view);
+    return INT2NUM(view->nitems);
+}
+
+static VALUE
+pl_view_dims(VALUE obj)
+{
+    struct pl_array_view *view;
+    VALUE res;
+    int i;
+
+    GetView(obj, view);
+    res = rb_ary_new2(view->ndim);
+    for (i = 0; i < view->ndim; i++) {
+        rb_ary_push(res, INT2NUM(view->dims[i]));
+    }
+    return res;
+}
+
+static VALUE
+pl_view_each(VALUE obj)
+{
+    struct pl_array_view *view;
+    int i;
+
+    GetView(obj, view);
+    for (i = 0; i < view->nitems; i++) {
+        rb_yield(pl_view_elem(view, i));
+    }
+    return obj;
+}
+
+static VALUE
+pl_view_nested(struct pl_array_view *view, int index, int *i)
+{
+    VALUE res;
+    int j;
+
+    res = rb_ary_new2(view->dims[index]);
+    for (j = 0; j < view->dims[index]; j++) {
+        if (index == view->ndim - 1) {
+            rb_ary_push(res, pl_view_elem(view, (*i)++));
+        }
+        else {
+            rb_ary_push(res, pl_view_nested(view, index + 1, i));
+        }
+    }
+    return res;
+}
+
+static VALUE
+pl_view_to_a(VALUE obj)
+{
+    struct pl_array_view *view;
+    int i = 0;
+
+    GetView(obj, view);
+    if (!view->nitems) {
+        return rb_ary_new2(0);
+    }
+    return pl_view_nested(view, 0, &i);
+}
+
+void
+Init_plruby_array()
+{
+    VALUE pl_mPL;
+
+    pl_mPL = rb_const_get(rb_cObject, rb_intern("PL"));
+    pl_ePLruby = rb_const_get(pl_mPL, rb_intern("Error"));
+    pl_cArrayView = rb_define_class_under(pl_mPL, "ArrayView", rb_cObject);
+    rb_include_module(pl_cArrayView, rb_mEnumerable);
+#if HAVE_RB_DEFINE_ALLOC_FUNC
+    rb_undef_alloc_func(pl_cArrayView);
+#else
+    rb_undef_method(CLASS_OF(pl_cArrayView), "allocate");
+#endif
+    rb_undef_method(CLASS_OF(pl_cArrayView), "new");
+    rb_define_singleton_method(pl_cArrayView, "arg", pl_view_s_arg, 1);
+    rb_define_method(pl_cArrayView, "[]", pl_view_aref, -1);
+    rb_define_method(pl_cArrayView, "null?", pl_view_null_p, -1);
+    rb_define_method(pl_cArrayView, "size", pl_view_size, 0);
+    rb_define_method(pl_cArrayView, "length", pl_view_size, 0);
+    rb_define_method(pl_cArrayView, "dims", pl_view_dims, 0);
+    rb_define_method(pl_cArrayView, "each", pl_view_each, 0);
+    rb_define_method(pl_cArrayView, "to_a", pl_view_to_a, 0);
+}
@@ -3,7 +3,7 @@
 static VALUE pl_ePLruby, pl_mPLtemp;
 static VALUE pl_mPL, pl_cPLPlan, pl_eCatch;
 
-static ID id_thr;
+static ID id_thr, id_call, id_plruby_tuple;
 
 static VALUE pl_SPI_exec _((int, VALUE *, VALUE));
 
@@ -93,15 +93,29 @@ pl_column_type(VALUE obj, VALUE table)
     return res;
 }
 
+/* SETOF in ValuePerCall mode runs the function in a Fiber */
+#if defined(HAVE_RB_FIBER_NEW) && PG_PL_VERSION >= 92
+#define PL_SRF_FIBER 1
+#endif
+
 struct pl_tuple {
     MemoryContext cxt;
     AttInMetadata *att;
     pl_proc_desc *pro;
     TupleDesc dsc;
     Tuplestorestate *out;
+    struct pl_out_meta *outm;
+    int emit;
     PG_FUNCTION_ARGS;
+#ifdef PL_SRF_FIBER
+    pg_stack_base_t base;
+#endif
 };
 
+/* how PL.emit_rows gives the rows back, see pl_tuple.emit */
+#define PL_EMIT_STORE 1
+#define PL_EMIT_FIBER 2
+
 #if PG_PL_VERSION >= 75
 #define SortMem work_mem
 #endif
@@ -110,6 +124,8 @@ extern int SortMem;
 
 static void pl_thr_mark(struct pl_tuple *tpl) {}
 
+static VALUE pl_tuples;
+
 #define GetTuple(tmp_, tpl_) do {                               \
     if (TYPE(tmp_) != T_DATA ||                                 \
         RDATA(tmp_)->dmark != (RUBY_DATA_FUNC)pl_thr_mark) {    \
@@ -273,6 +289,32 @@ pl_args_type(VALUE obj)
     return res;
 }
 
+/* datum and type of the argument n of the function running, 0 if NULL */
+int
+plruby_call_arg(int n, Datum *value, Oid *typoid)
+{
+    struct pl_tuple *tpl;
+    VALUE tmp;
+
+    tmp = rb_thread_local_aref(rb_thread_current(), id_thr);
+    if (NIL_P(tmp)) {
+        rb_raise(pl_ePLruby, "no function is running");
+    }
+    GetTuple(tmp, tpl);
+    if (!tpl->fcinfo || n < 0 || n >= tpl->pro->nargs) {
+        rb_raise(pl_ePLruby, "invalid argument number %d", n);
+    }
+    if (!tpl->pro->arg_is_array[n]) {
+        rb_raise(pl_ePLruby, "argument %d is not an array", n);
+    }
+    if (tpl->fcinfo->argnull[n]) {
+        return 0;
+    }
+    *value = tpl->fcinfo->arg[n];
+    *typoid = tpl->pro->arg_type[n];
+    return 1;
+}
+
 static VALUE PLcontext;
 
 struct PL_node
@@ -338,6 +380,68 @@ pl_context_remove()
     }
 }
 
+static struct pl_out_meta *pl_out_meta_new _((TupleDesc, AttInMetadata *));
+
+/*
+ * The column conversions of the rows returned by a function, kept on
+ * flinfo->fn_extra for the query. For a set returned in materialize
+ * mode fn_extra is not used by funcapi
+ */
+static struct pl_out_meta *
+pl_out_meta_cached(PG_FUNCTION_ARGS, TupleDesc dsc)
+{
+#if PG_PL_VERSION >= 75
+    FmgrInfo *flinfo;
+    struct pl_fn_extra *extra;
+    struct pl_out_meta *meta;
+    MemoryContext oldcxt;
+    AttInMetadata *att;
+
+    if (!fcinfo->flinfo) {
+        return NULL;
+    }
+    flinfo = fcinfo->flinfo;
+    extra = (struct pl_fn_extra *)flinfo->fn_extra;
+    if (!extra) {
+        if (!flinfo->fn_retset) {
+            return NULL;
+        }
+        PLRUBY_BEGIN_PROTECT(1);
+        extra = (struct pl_fn_extra *)
+            MemoryContextAlloc(flinfo->fn_mcxt, sizeof(struct pl_fn_extra));
+        MEMZERO(extra, struct pl_fn_extra, 1);
+        PLRUBY_END_PROTECT;
+        flinfo->fn_extra = (void *)extra;
+    }
+    meta = (struct pl_out_meta *)extra->out;
+    if (meta && meta->dsc == dsc) {
+        return meta;
+    }
+    /* a new descriptor for the same row type each call : keep a copy */
+    PLRUBY_BEGIN_PROTECT(1);
+    if (meta && equalTupleDescs(meta->dsc, dsc)) {
+        att = NULL;
+    }
+    else {
+        oldcxt = MemoryContextSwitchTo(flinfo->fn_mcxt);
+        dsc = CreateTupleDescCopyConstr(dsc);
+        att = TupleDescGetAttInMetadata(dsc);
+        MemoryContextSwitchTo(oldcxt);
+    }
+    PLRUBY_END_PROTECT;
+    if (!att) {
+        return meta;
+    }
+    oldcxt = MemoryContextSwitchTo(flinfo->fn_mcxt);
+    meta = pl_out_meta_new(dsc, att);
+    MemoryContextSwitchTo(oldcxt);
+    extra->out = (void *)meta;
+    return meta;
+#else
+    return NULL;
+#endif
+}
+
 static VALUE
 pl_tuple_s_new(PG_FUNCTION_ARGS, pl_proc_desc *prodesc)
 {
@@ -359,7 +463,13 @@ pl_tuple_s_new(PG_FUNCTION_ARGS, pl_proc_desc *prodesc)
     GetTuple(res, tpl);
     tpl->cxt = rsi->econtext->ecxt_per_query_memory;
     tpl->dsc = rsi->expectedDesc;
-    tpl->att = TupleDescGetAttInMetadata(tpl->dsc);
+    tpl->outm = pl_out_meta_cached(fcinfo, tpl->dsc);
+    if (tpl->outm) {
+        tpl->att = tpl->outm->att;
+    }
+    else {
+        tpl->att = TupleDescGetAttInMetadata(tpl->dsc);
+    }
     tpl->pro = prodesc;
     rb_thread_local_aset(rb_thread_current(), id_thr, res);
     return res;
@@ -378,6 +488,20 @@ struct datum_value {
 
 static void pl_conv_mark() {}
 
+static VALUE
+pl_conversion_class(Oid typoid)
+{
+    VALUE vid, klass;
+
+    vid = INT2NUM(typoid);
+    klass = rb_hash_aref(plruby_classes, vid);
+    if (NIL_P(klass)) {
+        klass = plruby_conversion_class(typoid);
+        rb_hash_aset(plruby_classes, vid, klass);
+    }
+    return klass;
+}
+
 Oid plruby_datum_oid(VALUE obj, int *typlen)
 {
     struct datum_value *dv;
@@ -426,14 +550,19 @@ plruby_to_datum(VALUE obj, FmgrInfo *finfo, Oid typoid,
     Datum d;
     VALUE tmp;
 
-    tmp = rb_attr_get(obj, rb_intern("plruby_tuple"));
-    if (TYPE(tmp) == T_DATA) {
-	return (Datum)DATA_PTR(tmp);
+    /* only a row given as argument carries its tuple */
+    if (TYPE(obj) == T_HASH) {
+        tmp = rb_attr_get(obj, id_plruby_tuple);
+        if (TYPE(tmp) == T_DATA) {
+            return (Datum)DATA_PTR(tmp);
+        }
     }
     if (typoid == BOOLOID) {
         return BoolGD(RTEST(obj));
     }
 #ifdef PLRUBY_ENABLE_CONVERSION
+    /* a module only converts to its own types : load it on first use */
+    pl_conversion_class(typoid);
     if (rb_respond_to(obj, id_to_datum)) {
         struct datum_value *dv;
         VALUE res;
@@ -459,14 +588,61 @@ plruby_to_datum(VALUE obj, FmgrInfo *finfo, Oid typoid,
     return d;
 }
 
+/*
+ * Fill values and nulls from nested arrays of the dimensions dim with a
+ * native conversion. Return 0 when the array is not regular or when an
+ * element is not of the class expected by the conversion
+ */
+static int
+pl_array_fill(VALUE ary, int index, int ndim, int *dim, 
+              plruby_result_conv conv, Datum *values, bool *nulls, int *nth)
+{
+    VALUE elem;
+    long i;
+
+    if (TYPE(ary) != T_ARRAY || RARRAY_LEN(ary) != dim[index]) {
+        return 0;
+    }
+    for (i = 0; i < dim[index]; i++) {
+        elem = RARRAY_PTR(ary)[i];
+        if (index < ndim - 1) {
+            if (!pl_array_fill(elem, index + 1, ndim, dim, conv, 
+                               values, nulls, nth)) {
+                return 0;
+            }
+            continue;
+        }
+        if (NIL_P(elem)) {
+#if PG_PL_VERSION >= 82
+            values[*nth] = (Datum)0;
+            nulls[(*nth)++] = true;
+            continue;
+#else
+            return 0;
+#endif
+        }
+        if (!conv(elem, &values[*nth])) {
+            return 0;
+        }
+        nulls[(*nth)++] = false;
+    }
+    return 1;
+}
+
 Datum
 plruby_return_array(VALUE ary, pl_proc_desc *p)
 {
     VALUE tmp;
     int i, total, ndim, *dim, *lbs;
     Datum *values;
+    bool *nulls;
     ArrayType *array;
+    plruby_result_conv conv;
 
+    if (OidIsValid(p->result_elem) &&
+        plruby_vector_elemtype(ary) == p->result_elem) {
+        return plruby_vector_datum(ary, p->result_elem);
+    }
     tmp = rb_Array(ary);
     total = 1;
     dim = ALLOCA_N(int, MAXDIM);
@@ -480,9 +656,10 @@ plruby_return_array(VALUE ary, pl_proc_desc *p)
         if (i == MAXDIM) {
             rb_raise(pl_ePLruby, "too many dimensions -- max %d", MAXDIM);
         }
-        if (RARRAY_LEN(tmp)) {
-            total *= RARRAY_LEN(tmp);
+        if (!RARRAY_LEN(tmp)) {
+            break;
         }
+        total *= RARRAY_LEN(tmp);
         tmp = RARRAY_PTR(tmp)[0];
     }
     ndim = i;
@@ -491,13 +668,36 @@ plruby_return_array(VALUE ary, pl_proc_desc *p)
         rb_raise(rb_eNotImpError, "multi-dimensional array only for >= 7.4");
     }
 #endif
-    ary = rb_funcall2(ary, rb_intern("flatten"), 0, 0);
-    if (RARRAY_LEN(ary) != total) {
-#ifdef WARNING
-        elog(WARNING, "not a regular array");
+    conv = plruby_result_converter(p->result_elem);
+    if (conv && dim[ndim - 1]) {
+        PLRUBY_BEGIN_PROTECT(1);
+        values = (Datum *)palloc(total * sizeof(Datum));
+        nulls = (bool *)palloc(total * sizeof(bool));
+        PLRUBY_END_PROTECT;
+        i = 0;
+        if (pl_array_fill(rb_Array(ary), 0, ndim, dim, conv,
+                          values, nulls, &i) && i == total) {
+            PLRUBY_BEGIN_PROTECT(1);
+#if PG_PL_VERSION >= 82
+            array = construct_md_array(values, nulls, ndim, dim, lbs,
+                                       p->result_elem, p->result_len,
+                                       p->result_val, p->result_align);
+#elif PG_PL_VERSION >= 74
+            array = construct_md_array(values, ndim, dim, lbs,
+                                       p->result_elem, p->result_len,
+                                       p->result_val, p->result_align);
 #else
-        elog(NOTICE, "not a regular array");
+            array = construct_array(values, dim[0], p->result_elem, 
+                                    p->result_len, p->result_val, 
+                                    p->result_align);
 #endif
+            PLRUBY_END_PROTECT;
+            return PointerGD(array);
+        }
+    }
+    ary = rb_funcall2(ary, rb_intern("flatten"), 0, 0);
+    if (RARRAY_LEN(ary) != total) {
+        rb_raise(pl_ePLruby, "not a regular array");
     }
     values = (Datum *)palloc(RARRAY_LEN(ary) * sizeof(Datum));
     for (i = 0; i < RARRAY_LEN(ary); ++i) {
@@ -525,238 +725,678 @@ plruby_return_array(VALUE ary, pl_proc_desc *p)
     return PointerGD(array);
 }
 
-static Datum
-return_base_type(VALUE c, pl_proc_desc *prodesc)
+/*
+ * Native conversions for the builtin scalar types, selected by
+ * pl_compile : no hash lookup, no method call and no text round-trip
+ */
+
+static VALUE
+pl_bool_value(Datum d)
 {
-    Datum retval;
+    return DatumGetBool(d)?Qtrue:Qfalse;
+}
 
-    if (prodesc->result_is_array) {
-        retval = plruby_return_array(c, prodesc);
-    }
-    else {
-        retval = plruby_to_datum(c, &prodesc->result_func,
-                                 prodesc->result_oid, 
-                                 prodesc->result_elem,
-                                 -1);
+static VALUE
+pl_text_value(Datum d)
+{
+    text *t;
+    VALUE res;
+
+    PLRUBY_BEGIN_PROTECT(1);
+    t = DatumGetTextP(d);
+    PLRUBY_END_PROTECT;
+    res = rb_tainted_str_new(VARDATA(t), VARSIZE(t) - VARHDRSZ);
+    if ((Pointer)t != DatumGetPointer(d)) {
+        pfree(t);
     }
-    return retval;
+    return res;
 }
 
-struct each_st {
-    VALUE res;
-    TupleDesc tup;
-};
+#ifdef PLRUBY_ENABLE_CONVERSION
 
-static HeapTuple
-pl_tuple_heap(VALUE c, VALUE tuple)
+static VALUE
+pl_int2_value(Datum d)
 {
-    HeapTuple retval;
-    struct pl_tuple *tpl;
-    TupleDesc tupdesc = 0;
-    Datum *dvalues;
-    Oid typid;
-    char *nulls;
-    int i;
+    return INT2FIX(DatumGetInt16(d));
+}
 
-    
-    GetTuple(tuple, tpl);
-    if (tpl->att) {
-	tupdesc = tpl->att->tupdesc;
-    }
-    if (!tupdesc) {
-	rb_raise(pl_ePLruby, "Invalid descriptor");
-    }
-    if (TYPE(c) != T_ARRAY) {
-	if (NIL_P(c) || (TYPE(c) == T_STRING && !RSTRING_LEN(c))) {
-	    c = rb_ary_new2(1);
-	    rb_ary_push(c, rb_str_new2(""));
-	}
-	else {
-	    c = rb_Array(c);
-	}
-    }
-    if (TYPE(c) != T_ARRAY || !RARRAY_PTR(c)) {
-        rb_raise(pl_ePLruby, "expected an Array");
-    }
-    if (tupdesc->natts != RARRAY_LEN(c)) {
-        rb_raise(pl_ePLruby, "Invalid number of rows (%d expected %d)",
-                 RARRAY_LEN(c), tupdesc->natts);
-    }
-    dvalues = ALLOCA_N(Datum, RARRAY_LEN(c));
-    MEMZERO(dvalues, Datum, RARRAY_LEN(c));
-    nulls = ALLOCA_N(char, RARRAY_LEN(c));
-    MEMZERO(nulls, char, RARRAY_LEN(c));
-    for (i = 0; i < RARRAY_LEN(c); i++) {
-        if (NIL_P(RARRAY_PTR(c)[i]) || 
-            tupdesc->attrs[i]->attisdropped) {
-            dvalues[i] = (Datum)0;
-            nulls[i] = 'n';
-        }
-        else {
-            nulls[i] = ' ';
-            typid =  tupdesc->attrs[i]->atttypid;
-            if (tupdesc->attrs[i]->attndims != 0 ||
-		tpl->att->attinfuncs[i].fn_addr == (PGFunction)array_in) {
-                pl_proc_desc prodesc;
-                FmgrInfo func;
-                HeapTuple hp;
-                Form_pg_type fpg;
-
-                MEMZERO(&prodesc, pl_proc_desc, 1);
-                PLRUBY_BEGIN(1);
-                hp = SearchSysCache(TYPEOID, OidGD(typid), 0, 0, 0);
-                if (!HeapTupleIsValid(hp)) {
-                    rb_raise(pl_ePLruby, "cache lookup failed for type %u",
-                             typid);
-                }
-                fpg = (Form_pg_type) GETSTRUCT(hp);
-#if PG_PL_VERSION >= 75
-                typid = getTypeIOParam(hp);
-#else
-                typid = fpg->typelem;
-#endif
-                ReleaseSysCache(hp);
-                hp = SearchSysCache(TYPEOID, OidGD(typid), 0, 0, 0);
-                PLRUBY_END;
-                if (!HeapTupleIsValid(hp)) {
-                    rb_raise(pl_ePLruby, "cache lookup failed for type %u",
-                             typid);
-                }
-                fpg = (Form_pg_type) GETSTRUCT(hp);
-                fmgr_info(fpg->typinput, &func);
-                prodesc.result_func = func;
-                prodesc.result_oid = typid;
-                prodesc.result_elem = typid;
-                prodesc.result_val = fpg->typbyval;
-                prodesc.result_len = fpg->typlen;
-                prodesc.result_align = fpg->typalign;
-                ReleaseSysCache(hp);
-                dvalues[i] = plruby_return_array(RARRAY_PTR(c)[i], &prodesc);
-            }
-            else  {
-#if PG_PL_VERSION >= 75
-		dvalues[i] = plruby_to_datum(RARRAY_PTR(c)[i],
-					     &tpl->att->attinfuncs[i],
-					     typid,
-					     tpl->att->attioparams[i],
-					     tpl->att->atttypmods[i]);
-#else
-                dvalues[i] = plruby_to_datum(RARRAY_PTR(c)[i],
-                                             &tpl->att->attinfuncs[i],
-                                             typid,
-                                             tpl->att->attelems[i],
-                                             tpl->att->atttypmods[i]);
-#endif
-            }
-        }
-    }
-    PLRUBY_BEGIN_PROTECT(1);
-    retval = heap_formtuple(tupdesc, dvalues, nulls);
-    PLRUBY_END_PROTECT;
-    return retval;
+static VALUE
+pl_int4_value(Datum d)
+{
+    return INT2NUM(DatumGetInt32(d));
 }
 
 static VALUE
-pl_tuple_put(VALUE c, VALUE tuple)
+pl_int8_value(Datum d)
 {
-    HeapTuple retval;
-    MemoryContext oldcxt;
-    struct pl_tuple *tpl;
+    return LL2NUM(DatumGetInt64(d));
+}
 
-    GetTuple(tuple, tpl);
-    retval = pl_tuple_heap(c, tuple);
-    PLRUBY_BEGIN_PROTECT(1);
-    oldcxt = MemoryContextSwitchTo(tpl->cxt);
-    if (!tpl->out) {
-#if PG_PL_VERSION >= 74
-        tpl->out = tuplestore_begin_heap(true, false, SortMem);
-#else
-        tpl->out = tuplestore_begin_heap(true, SortMem);
-#endif
-    }
-    tuplestore_puttuple(tpl->out, retval);
-    MemoryContextSwitchTo(oldcxt);
-    PLRUBY_END_PROTECT;
-    return Qnil;
+static VALUE
+pl_oid_value(Datum d)
+{
+    return UINT2NUM(DatumGetObjectId(d));
 }
 
 static VALUE
-pl_ary_collect(VALUE c, VALUE ary)
+pl_float4_value(Datum d)
 {
-    PLRUBY_BEGIN_PROTECT(1);
-    rb_ary_push(ary,c);
-    PLRUBY_END_PROTECT;
-    return Qnil;
+    return rb_float_new(DatumGetFloat4(d));
 }
 
-static Datum
-pl_tuple_datum(VALUE c, VALUE tuple)
+static VALUE
+pl_float8_value(Datum d)
 {
-    Datum retval;
-    HeapTuple tmp;
-    struct pl_tuple *tpl;
+    return rb_float_new(DatumGetFloat8(d));
+}
+
+static VALUE
+pl_bytea_value(Datum d)
+{
+    bytea *b;
+    VALUE res;
 
-    GetTuple(tuple, tpl);
-    tmp = pl_tuple_heap(c, tuple);
     PLRUBY_BEGIN_PROTECT(1);
-    retval = TupleGD(TupleDescGetSlot(tpl->att->tupdesc), tmp);
+    b = DatumGetByteaP(d);
     PLRUBY_END_PROTECT;
-    return retval;
+    res = rb_str_new(VARDATA(b), VARSIZE(b) - VARHDRSZ);
+    if ((Pointer)b != DatumGetPointer(d)) {
+        pfree(b);
+    }
+    return res;
 }
 
-struct pl_arg {
-    ID id;
-    int named;
-    VALUE ary;
-};
+#endif
 
-static void
-pl_arg_mark(struct pl_arg *args)
+plruby_arg_conv
+plruby_arg_converter(Oid typoid)
 {
-    rb_gc_mark(args->ary);
+    switch (typoid) {
+    case BOOLOID: return pl_bool_value;
+    case TEXTOID: case VARCHAROID: return pl_text_value;
+#ifdef PLRUBY_ENABLE_CONVERSION
+    case INT2OID: return pl_int2_value;
+    case INT4OID: return pl_int4_value;
+    case INT8OID: return pl_int8_value;
+    case OIDOID: return pl_oid_value;
+    case FLOAT4OID: return pl_float4_value;
+    case FLOAT8OID: return pl_float8_value;
+    case BYTEAOID: return pl_bytea_value;
+#endif
+    }
+    return NULL;
 }
 
-static VALUE
-pl_func(VALUE arg)
+#define PL_INTEGER_P(obj_) (FIXNUM_P(obj_) || TYPE(obj_) == T_BIGNUM)
+
+static int
+pl_bool_datum(VALUE obj, Datum *d)
 {
-#if HAVE_RB_BLOCK_CALL
-    return Qtrue;
-#else
-    struct pl_arg *args;
+    *d = BoolGD(RTEST(obj));
+    return 1;
+}
 
-    Data_Get_Struct(arg, struct pl_arg, args);
-    if (args->named) {
-        return rb_funcall2(pl_mPLtemp, args->id, RARRAY_LEN(args->ary),
-                          RARRAY_PTR(args->ary));
+static int
+pl_int2_datum(VALUE obj, Datum *d)
+{
+    long value;
+
+    if (!PL_INTEGER_P(obj)) {
+        return 0;
     }
-    return rb_funcall(pl_mPLtemp, args->id, 1, args->ary);
-#endif
+    value = NUM2LONG(obj);
+    if (value < SHRT_MIN || value > SHRT_MAX) {
+        rb_raise(pl_ePLruby, "value %ld is out of range for type smallint",
+                 value);
+    }
+    *d = Int16GetDatum((int16)value);
+    return 1;
 }
 
-static VALUE
-pl_string(VALUE arg)
+static int
+pl_int4_datum(VALUE obj, Datum *d)
 {
-    struct pl_arg *args;
-    VALUE tmp[2], plan;
+    if (!PL_INTEGER_P(obj)) {
+        return 0;
+    }
+    *d = Int32GetDatum(NUM2INT(obj));
+    return 1;
+}
 
-    Data_Get_Struct(arg, struct pl_arg, args);
-    tmp[0] = args->ary;
-    tmp[1] = rb_hash_new();
-    rb_hash_aset(tmp[1], rb_str_new2("block"), INT2NUM(50));
-    rb_hash_aset(tmp[1], rb_str_new2("output"), rb_str_new2("value"));
-    plan = plruby_s_new(2, tmp, pl_cPLPlan);
-#if HAVE_RB_BLOCK_CALL
-    return plan;
+static int
+pl_int8_datum(VALUE obj, Datum *d)
+{
+    int64 value;
+
+    if (!PL_INTEGER_P(obj)) {
+        return 0;
+    }
+    value = NUM2LL(obj);
+#ifdef USE_FLOAT8_BYVAL
+    *d = Int64GetDatum(value);
 #else
-    rb_funcall2(plan, rb_intern("each"), 0, 0);
-    return Qnil;
+    PLRUBY_BEGIN_PROTECT(1);
+    *d = Int64GetDatum(value);
+    PLRUBY_END_PROTECT;
 #endif
+    return 1;
 }
- 
-static VALUE
-pl_warn(argc, argv, obj)
-    int argc;
-    VALUE *argv;
+
+static int
+pl_oid_datum(VALUE obj, Datum *d)
+{
+    if (!PL_INTEGER_P(obj)) {
+        return 0;
+    }
+    *d = ObjectIdGetDatum(NUM2UINT(obj));
+    return 1;
+}
+
+static int
+pl_float4_datum(VALUE obj, Datum *d)
+{
+    if (TYPE(obj) != T_FLOAT && !PL_INTEGER_P(obj)) {
+        return 0;
+    }
+    *d = Float4GetDatum((float4)NUM2DBL(obj));
+    return 1;
+}
+
+static int
+pl_float8_datum(VALUE obj, Datum *d)
+{
+    double value;
+
+    if (TYPE(obj) != T_FLOAT && !PL_INTEGER_P(obj)) {
+        return 0;
+    }
+    value = NUM2DBL(obj);
+#ifdef USE_FLOAT8_BYVAL
+    *d = Float8GetDatum(value);
+#else
+    PLRUBY_BEGIN_PROTECT(1);
+    *d = Float8GetDatum(value);
+    PLRUBY_END_PROTECT;
+#endif
+    return 1;
+}
+
+static int
+pl_text_datum(VALUE obj, Datum *d)
+{
+    text *t;
+    long len;
+
+    if (TYPE(obj) != T_STRING) {
+        return 0;
+    }
+    len = RSTRING_LEN(obj);
+    /* the input function stops at the first NUL */
+    if (memchr(RSTRING_PTR(obj), 0, len)) {
+        return 0;
+    }
+    PLRUBY_BEGIN_PROTECT(1);
+    t = (text *)palloc(VARHDRSZ + len);
+#ifdef SET_VARSIZE
+    SET_VARSIZE(t, VARHDRSZ + len);
+#else
+    VARATT_SIZEP(t) = VARHDRSZ + len;
+#endif
+    PLRUBY_END_PROTECT;
+    memcpy(VARDATA(t), RSTRING_PTR(obj), len);
+    *d = PointerGD(t);
+    return 1;
+}
+
+#ifdef PLRUBY_ENABLE_CONVERSION
+
+static int
+pl_bytea_datum(VALUE obj, Datum *d)
+{
+    bytea *b;
+    long len;
+
+    if (TYPE(obj) != T_STRING) {
+        return 0;
+    }
+    len = RSTRING_LEN(obj);
+    PLRUBY_BEGIN_PROTECT(1);
+    b = (bytea *)palloc(VARHDRSZ + len);
+#ifdef SET_VARSIZE
+    SET_VARSIZE(b, VARHDRSZ + len);
+#else
+    VARATT_SIZEP(b) = VARHDRSZ + len;
+#endif
+    PLRUBY_END_PROTECT;
+    memcpy(VARDATA(b), RSTRING_PTR(obj), len);
+    *d = PointerGD(b);
+    return 1;
+}
+
+#endif
+
+/* the converters return 0 for an object of another class */
+plruby_result_conv
+plruby_result_converter(Oid typoid)
+{
+    switch (typoid) {
+    case BOOLOID: return pl_bool_datum;
+    case INT2OID: return pl_int2_datum;
+    case INT4OID: return pl_int4_datum;
+    case INT8OID: return pl_int8_datum;
+    case OIDOID: return pl_oid_datum;
+    case FLOAT4OID: return pl_float4_datum;
+    case FLOAT8OID: return pl_float8_datum;
+    case TEXTOID: case VARCHAROID: return pl_text_datum;
+#ifdef PLRUBY_ENABLE_CONVERSION
+    case BYTEAOID: return pl_bytea_datum;
+#endif
+    }
+    return NULL;
+}
+
+static Datum
+return_base_type(VALUE c, pl_proc_desc *prodesc)
+{
+    Datum retval;
+
+    if (prodesc->result_conv && prodesc->result_conv(c, &retval)) {
+        return retval;
+    }
+    if (prodesc->result_is_array) {
+        retval = plruby_return_array(c, prodesc);
+    }
+    else {
+        retval = plruby_to_datum(c, &prodesc->result_func,
+                                 prodesc->result_oid, 
+                                 prodesc->result_elem,
+                                 -1);
+    }
+    return retval;
+}
+
+struct each_st {
+    VALUE res;
+    TupleDesc tup;
+};
+
+/*
+ * Conversion of each column of a returned row, resolved once for a
+ * TupleDesc and kept for the query
+ */
+struct pl_out_column {
+    Oid typid;
+    bool dropped;
+    bool is_array;
+    plruby_result_conv conv;
+    FmgrInfo elem_func;
+    Oid elem;
+    int elem_len;
+    bool elem_val;
+    char elem_align;
+};
+
+struct pl_out_name {
+    char *name;
+    int attnum;
+};
+
+struct pl_out_meta {
+    TupleDesc dsc;
+    AttInMetadata *att;
+    struct pl_out_column *cols;
+    struct pl_out_name *names;
+    int nnames;
+};
+
+static int
+pl_out_name_cmp(const void *a, const void *b)
+{
+    return strcmp(((struct pl_out_name *)a)->name,
+                  ((struct pl_out_name *)b)->name);
+}
+
+/* allocated in the current memory context */
+static struct pl_out_meta *
+pl_out_meta_new(TupleDesc tupdesc, AttInMetadata *att)
+{
+    struct pl_out_meta *meta;
+    struct pl_out_column *col;
+    HeapTuple hp;
+    Form_pg_type fpg;
+    Oid typid;
+    int i;
+
+    PLRUBY_BEGIN_PROTECT(1);
+    meta = (struct pl_out_meta *)palloc(sizeof(struct pl_out_meta));
+    meta->dsc = tupdesc;
+    meta->att = att;
+    meta->cols = (struct pl_out_column *)
+        palloc0((tupdesc->natts + 1) * sizeof(struct pl_out_column));
+    meta->names = (struct pl_out_name *)
+        palloc((tupdesc->natts + 1) * sizeof(struct pl_out_name));
+    meta->nnames = 0;
+    for (i = 0, col = meta->cols; i < tupdesc->natts; i++, col++) {
+        col->typid = tupdesc->attrs[i]->atttypid;
+        col->dropped = tupdesc->attrs[i]->attisdropped;
+        if (col->dropped) {
+            continue;
+        }
+        meta->names[meta->nnames].name = NameStr(tupdesc->attrs[i]->attname);
+        meta->names[meta->nnames++].attnum = i;
+        if (tupdesc->attrs[i]->attndims == 0 &&
+            att->attinfuncs[i].fn_addr != (PGFunction)array_in) {
+            /* the input function checks the typmod, e.g. varchar(n) */
+            if (tupdesc->attrs[i]->atttypmod < 0) {
+                col->conv = plruby_result_converter(col->typid);
+            }
+            continue;
+        }
+        col->is_array = true;
+        hp = SearchSysCache(TYPEOID, OidGD(col->typid), 0, 0, 0);
+        if (!HeapTupleIsValid(hp)) {
+            elog(ERROR, "cache lookup failed for type %u", col->typid);
+        }
+#if PG_PL_VERSION >= 75
+        typid = getTypeIOParam(hp);
+#else
+        typid = ((Form_pg_type) GETSTRUCT(hp))->typelem;
+#endif
+        ReleaseSysCache(hp);
+        hp = SearchSysCache(TYPEOID, OidGD(typid), 0, 0, 0);
+        if (!HeapTupleIsValid(hp)) {
+            elog(ERROR, "cache lookup failed for type %u", typid);
+        }
+        fpg = (Form_pg_type) GETSTRUCT(hp);
+        fmgr_info(fpg->typinput, &col->elem_func);
+        col->elem = typid;
+        col->elem_val = fpg->typbyval;
+        col->elem_len = fpg->typlen;
+        col->elem_align = fpg->typalign;
+        ReleaseSysCache(hp);
+    }
+    qsort(meta->names, meta->nnames, sizeof(struct pl_out_name), 
+          pl_out_name_cmp);
+    PLRUBY_END_PROTECT;
+    return meta;
+}
+
+struct pl_hash_row {
+    struct pl_out_meta *meta;
+    VALUE row;
+};
+
+static int
+pl_hash_row_i(VALUE key, VALUE value, VALUE arg)
+{
+    struct pl_hash_row *hr = (struct pl_hash_row *)arg;
+    struct pl_out_name name, *found;
+
+    if (SYMBOL_P(key)) {
+        name.name = (char *)rb_id2name(SYM2ID(key));
+    }
+    else {
+        key = plruby_to_s(key);
+        name.name = RSTRING_PTR(key);
+    }
+    found = (struct pl_out_name *)bsearch(&name, hr->meta->names, 
+                                          hr->meta->nnames,
+                                          sizeof(struct pl_out_name),
+                                          pl_out_name_cmp);
+    if (!found) {
+        rb_raise(pl_ePLruby, "unknown column %s", name.name);
+    }
+    rb_ary_store(hr->row, found->attnum, value);
+    return ST_CONTINUE;
+}
+
+/* a Hash row : the values by column name, a missing column is NULL */
+static VALUE
+pl_hash_row(struct pl_out_meta *meta, VALUE c)
+{
+    struct pl_hash_row hr;
+
+    hr.meta = meta;
+    hr.row = rb_ary_new2(meta->dsc->natts);
+    if (meta->dsc->natts) {
+        rb_ary_store(hr.row, meta->dsc->natts - 1, Qnil);
+    }
+    rb_hash_foreach(c, pl_hash_row_i, (VALUE)&hr);
+    return hr.row;
+}
+
+#if PG_PL_VERSION >= 82
+#define PL_NULLS_T bool
+#define PL_SET_NULL(nulls_, i_, b_) ((nulls_)[i_] = (b_))
+#else
+#define PL_NULLS_T char
+#define PL_SET_NULL(nulls_, i_, b_) ((nulls_)[i_] = (b_)?'n':' ')
+#endif
+
+static struct pl_out_meta *
+pl_tuple_out_meta(struct pl_tuple *tpl)
+{
+    TupleDesc tupdesc = 0;
+
+    if (tpl->att) {
+	tupdesc = tpl->att->tupdesc;
+    }
+    if (!tupdesc) {
+	rb_raise(pl_ePLruby, "Invalid descriptor");
+    }
+    if (!tpl->outm) {
+        MemoryContext oldcxt = 0;
+
+        if (tpl->cxt) {
+            oldcxt = MemoryContextSwitchTo(tpl->cxt);
+        }
+        tpl->outm = pl_out_meta_new(tupdesc, tpl->att);
+        if (tpl->cxt) {
+            MemoryContextSwitchTo(oldcxt);
+        }
+    }
+    return tpl->outm;
+}
+
+/* convert one row into dvalues/nulls, which have room for natts values */
+static void
+pl_tuple_fill(VALUE c, struct pl_tuple *tpl, struct pl_out_meta *meta,
+              Datum *dvalues, PL_NULLS_T *nulls)
+{
+    struct pl_out_column *col;
+    TupleDesc tupdesc = tpl->att->tupdesc;
+    VALUE value;
+    int i;
+
+    if (TYPE(c) == T_HASH) {
+        c = pl_hash_row(meta, c);
+    }
+    else if (TYPE(c) != T_ARRAY) {
+	if (NIL_P(c) || (TYPE(c) == T_STRING && !RSTRING_LEN(c))) {
+	    c = rb_ary_new2(1);
+	    rb_ary_push(c, rb_str_new2(""));
+	}
+	else {
+	    c = rb_Array(c);
+	}
+    }
+    if (TYPE(c) != T_ARRAY || !RARRAY_PTR(c)) {
+        rb_raise(pl_ePLruby, "expected an Array");
+    }
+    if (tupdesc->natts != RARRAY_LEN(c)) {
+        rb_raise(pl_ePLruby, "Invalid number of rows (%d expected %d)",
+                 RARRAY_LEN(c), tupdesc->natts);
+    }
+    for (i = 0, col = meta->cols; i < RARRAY_LEN(c); i++, col++) {
+        value = RARRAY_PTR(c)[i];
+        if (NIL_P(value) || col->dropped) {
+            dvalues[i] = (Datum)0;
+            PL_SET_NULL(nulls, i, 1);
+            continue;
+        }
+        PL_SET_NULL(nulls, i, 0);
+        if (col->is_array) {
+            pl_proc_desc prodesc;
+
+            prodesc.result_func = col->elem_func;
+            prodesc.result_oid = col->elem;
+            prodesc.result_elem = col->elem;
+            prodesc.result_val = col->elem_val;
+            prodesc.result_len = col->elem_len;
+            prodesc.result_align = col->elem_align;
+            dvalues[i] = plruby_return_array(value, &prodesc);
+        }
+        else if (col->conv && col->conv(value, &dvalues[i])) {
+            continue;
+        }
+        else {
+#if PG_PL_VERSION >= 75
+            dvalues[i] = plruby_to_datum(value,
+                                         &tpl->att->attinfuncs[i],
+                                         col->typid,
+                                         tpl->att->attioparams[i],
+                                         tpl->att->atttypmods[i]);
+#else
+            dvalues[i] = plruby_to_datum(value,
+                                         &tpl->att->attinfuncs[i],
+                                         col->typid,
+                                         tpl->att->attelems[i],
+                                         tpl->att->atttypmods[i]);
+#endif
+        }
+    }
+}
+
+#if PG_PL_VERSION >= 82
+#define pl_form_tuple heap_form_tuple
+#else
+#define pl_form_tuple heap_formtuple
+#endif
+
+static HeapTuple
+pl_tuple_heap(VALUE c, VALUE tuple)
+{
+    HeapTuple retval;
+    struct pl_tuple *tpl;
+    struct pl_out_meta *meta;
+    TupleDesc tupdesc;
+    Datum *dvalues;
+    PL_NULLS_T *nulls;
+
+    GetTuple(tuple, tpl);
+    meta = pl_tuple_out_meta(tpl);
+    tupdesc = tpl->att->tupdesc;
+    dvalues = ALLOCA_N(Datum, tupdesc->natts);
+    MEMZERO(dvalues, Datum, tupdesc->natts);
+    nulls = ALLOCA_N(PL_NULLS_T, tupdesc->natts);
+    pl_tuple_fill(c, tpl, meta, dvalues, nulls);
+    PLRUBY_BEGIN_PROTECT(1);
+    retval = pl_form_tuple(tupdesc, dvalues, nulls);
+    PLRUBY_END_PROTECT;
+    return retval;
+}
+
+static VALUE
+pl_tuple_put(VALUE c, VALUE tuple)
+{
+    HeapTuple retval;
+    MemoryContext oldcxt;
+    struct pl_tuple *tpl;
+
+    GetTuple(tuple, tpl);
+    retval = pl_tuple_heap(c, tuple);
+    PLRUBY_BEGIN_PROTECT(1);
+    oldcxt = MemoryContextSwitchTo(tpl->cxt);
+    if (!tpl->out) {
+#if PG_PL_VERSION >= 74
+        tpl->out = tuplestore_begin_heap(true, false, SortMem);
+#else
+        tpl->out = tuplestore_begin_heap(true, SortMem);
+#endif
+    }
+    tuplestore_puttuple(tpl->out, retval);
+    MemoryContextSwitchTo(oldcxt);
+    PLRUBY_END_PROTECT;
+    return Qnil;
+}
+
+static VALUE
+pl_ary_collect(VALUE c, VALUE ary)
+{
+    PLRUBY_BEGIN_PROTECT(1);
+    rb_ary_push(ary,c);
+    PLRUBY_END_PROTECT;
+    return Qnil;
+}
+
+static Datum
+pl_tuple_datum(VALUE c, VALUE tuple)
+{
+    Datum retval;
+    HeapTuple tmp;
+    struct pl_tuple *tpl;
+
+    GetTuple(tuple, tpl);
+    tmp = pl_tuple_heap(c, tuple);
+    PLRUBY_BEGIN_PROTECT(1);
+    retval = TupleGD(TupleDescGetSlot(tpl->att->tupdesc), tmp);
+    PLRUBY_END_PROTECT;
+    return retval;
+}
+
+struct pl_arg {
+    pl_proc_desc *pro;
+    int named;
+    VALUE ary;
+};
+
+static void
+pl_arg_mark(struct pl_arg *args)
+{
+    rb_gc_mark(args->ary);
+}
+
+static VALUE
+pl_func(VALUE arg)
+{
+#if HAVE_RB_BLOCK_CALL
+    return Qtrue;
+#else
+    struct pl_arg *args;
+
+    Data_Get_Struct(arg, struct pl_arg, args);
+    if (args->named) {
+        return plruby_proc_call(args->pro, RARRAY_LEN(args->ary),
+                                RARRAY_PTR(args->ary));
+    }
+    return plruby_proc_call(args->pro, 1, &args->ary);
+#endif
+}
+
+static VALUE
+pl_string(VALUE arg)
+{
+    struct pl_arg *args;
+    VALUE tmp[2], plan;
+
+    Data_Get_Struct(arg, struct pl_arg, args);
+    tmp[0] = args->ary;
+    tmp[1] = rb_hash_new();
+    rb_hash_aset(tmp[1], rb_str_new2("block"), INT2NUM(50));
+    rb_hash_aset(tmp[1], rb_str_new2("output"), rb_str_new2("value"));
+    plan = plruby_s_new(2, tmp, pl_cPLPlan);
+#if HAVE_RB_BLOCK_CALL
+    return plan;
+#else
+    rb_funcall2(plan, rb_intern("each"), 0, 0);
+    return Qnil;
+#endif
+}
+ 
+static VALUE
+pl_warn(argc, argv, obj)
+    int argc;
+    VALUE *argv;
     VALUE obj;
 {
     int level, indice;
@@ -835,40 +1475,308 @@ pl_quote(obj, mes)
 {    
     char *tmp, *cp1, *cp2;
 
-    if (TYPE(mes) != T_STRING || !RSTRING_PTR(mes)) {
-        rb_raise(pl_ePLruby, "quote: string expected");
+    if (TYPE(mes) != T_STRING || !RSTRING_PTR(mes)) {
+        rb_raise(pl_ePLruby, "quote: string expected");
+    }
+    tmp = ALLOCA_N(char, RSTRING_LEN(mes) * 2 + 1);
+    cp1 = RSTRING_PTR(mes);
+    cp2 = tmp;
+    while (*cp1) {
+        if (*cp1 == '\'')
+            *cp2++ = '\'';
+        else {
+            if (*cp1 == '\\')
+                *cp2++ = '\\';
+        }
+        *cp2++ = *cp1++;
+    }
+    *cp2 = '\0';
+    return rb_tainted_str_new2(tmp);
+}
+
+void
+plruby_exec_output(VALUE option, int compose, int *result)
+{
+    if (TYPE(option) != T_STRING || RSTRING_PTR(option) == 0 || !result) {
+        rb_raise(pl_ePLruby, "string expected for optional output");
+    }
+    if (strcmp(RSTRING_PTR(option), "array") == 0) {
+        *result = compose|RET_DESC_ARR;
+    }
+    else if (strcmp(RSTRING_PTR(option), "hash") == 0) {
+        *result = compose|RET_DESC;
+    }
+    else if (strcmp(RSTRING_PTR(option), "value") == 0) {
+        *result = RET_ARRAY;
+    }
+    else if (strcmp(RSTRING_PTR(option), "symbol_hash") == 0) {
+        *result = RET_HASH|RET_SYMBOL;
+    }
+    else if (strcmp(RSTRING_PTR(option), "columns") == 0) {
+        *result = RET_COLUMNS;
+    }
+    else if (strcmp(RSTRING_PTR(option), "packed_columns") == 0) {
+        *result = RET_COLUMNS|RET_PACKED;
+    }
+}
+
+#if PG_PL_VERSION >= 81
+
+/*
+ * exec with a block : a SELECT is read through a portal, the first
+ * fetch is small and each next fetch is twice larger up to "block"
+ */
+#define PL_EXEC_FIRST 16
+#define PL_EXEC_BLOCK 1024
+
+struct pl_exec_stream {
+    Portal portal;
+    void *entry;
+    int count, block, output;
+};
+
+static VALUE
+pl_exec_fetch(VALUE arg)
+{
+    struct pl_exec_stream *st = (struct pl_exec_stream *)arg;
+    SPITupleTable *tuptab;
+    volatile VALUE meta, rows;
+    int i, proces, fetched, block;
+
+    fetched = 0;
+    block = (PL_EXEC_FIRST < st->block)?PL_EXEC_FIRST:st->block;
+    while (!st->count || fetched < st->count) {
+        plruby_spi_connect();
+        PLRUBY_BEGIN_PROTECT(1);
+        SPI_cursor_fetch(st->portal, true, block);
+        PLRUBY_END_PROTECT;
+        if (SPI_processed <= 0) {
+            break;
+        }
+        proces = SPI_processed;
+        if (st->count && proces > st->count - fetched) {
+            proces = st->count - fetched;
+        }
+        tuptab = SPI_tuptable;
+        meta = plruby_tuple_meta(tuptab->tupdesc);
+        rows = rb_ary_new2(proces);
+        for (i = 0; i < proces; ++i) {
+            rb_ary_push(rows, plruby_build_tuple_meta(tuptab->vals[i], meta,
+                                                      st->output));
+        }
+        SPI_freetuptable(tuptab);
+        /* the block can leave SPI, e.g. to give a row of a SETOF function */
+        for (i = 0; i < proces; ++i, ++fetched) {
+            rb_yield(RARRAY_PTR(rows)[i]);
+        }
+        if (block < st->block) {
+            block *= 2;
+            if (block > st->block) {
+                block = st->block;
+            }
+        }
+    }
+    return fetched?Qtrue:Qfalse;
+}
+
+static VALUE
+pl_exec_close(VALUE arg)
+{
+    struct pl_exec_stream *st = (struct pl_exec_stream *)arg;
+
+    PLRUBY_BEGIN_PROTECT(1);
+    if (!PORTAL_ACTIVE(st->portal)) {
+        SPI_cursor_close(st->portal);
+    }
+    PLRUBY_END_PROTECT;
+    /* the cached plan is used by the portal until it's closed */
+    plruby_plan_release(st->entry);
+    return Qnil;
+}
+
+#endif
+
+#if PG_PL_VERSION >= 84
+
+/*
+ * exec with values : the type of a value is given by "types" (a type
+ * name or an oid), otherwise it's int8, numeric, float8 or bool from its
+ * class. The type of nil or a String is inferred by the parser (from
+ * PostgreSQL 9.0) : as text it wouldn't compare with an integer column.
+ * The values are converted by the native converters when they exist,
+ * and the query is parsed once with these types
+ */
+static Oid
+pl_param_type(VALUE type, VALUE value)
+{
+    Oid typoid;
+    int32 typmod;
+
+    if (NIL_P(type)) {
+        switch (TYPE(value)) {
+        case T_FIXNUM:
+            return INT8OID;
+        case T_BIGNUM:
+            return NUMERICOID;
+        case T_FLOAT:
+            return FLOAT8OID;
+        case T_TRUE:
+        case T_FALSE:
+            return BOOLOID;
+#if PG_PL_VERSION >= 90
+        case T_NIL:
+        case T_STRING:
+            return InvalidOid;
+#else
+        case T_NIL:
+            return TEXTOID;
+#endif
+        default:
+            rb_raise(pl_ePLruby, "exec : the type of a %s value must be "
+                     "given in \"types\"", rb_obj_classname(value));
+        }
+    }
+    if (FIXNUM_P(type)) {
+        return NUM2UINT(type);
+    }
+    type = plruby_to_s(type);
+    PLRUBY_BEGIN_PROTECT(1);
+#if PG_PL_VERSION >= 94
+    parseTypeString(RSTRING_PTR(type), &typoid, &typmod, false);
+#else
+    parseTypeString(RSTRING_PTR(type), &typoid, &typmod);
+#endif
+    PLRUBY_END_PROTECT;
+    return typoid;
+}
+
+static Datum
+pl_param_datum(VALUE value, Oid typoid)
+{
+    plruby_result_conv conv;
+    pl_proc_desc prodesc;
+    HeapTuple hp;
+    Form_pg_type fpg;
+    Oid elem;
+    Datum retval;
+
+    if ((conv = plruby_result_converter(typoid)) && conv(value, &retval)) {
+        return retval;
+    }
+    MEMZERO(&prodesc, pl_proc_desc, 1);
+    prodesc.result_oid = typoid;
+    PLRUBY_BEGIN_PROTECT(1);
+    hp = SearchSysCache(TYPEOID, OidGD(typoid), 0, 0, 0);
+    if (!HeapTupleIsValid(hp)) {
+        elog(ERROR, "cache lookup failed for type %u", typoid);
+    }
+    fpg = (Form_pg_type) GETSTRUCT(hp);
+    elem = getTypeIOParam(hp);
+    if (fpg->typlen == -1 && OidIsValid(fpg->typelem)) {
+        ReleaseSysCache(hp);
+        hp = SearchSysCache(TYPEOID, OidGD(elem), 0, 0, 0);
+        if (!HeapTupleIsValid(hp)) {
+            elog(ERROR, "cache lookup failed for type %u", elem);
+        }
+        fpg = (Form_pg_type) GETSTRUCT(hp);
+        prodesc.result_is_array = true;
+        prodesc.result_val = fpg->typbyval;
+        prodesc.result_len = fpg->typlen;
+        prodesc.result_align = fpg->typalign;
+    }
+    fmgr_info(fpg->typinput, &prodesc.result_func);
+    prodesc.result_elem = elem;
+    ReleaseSysCache(hp);
+    PLRUBY_END_PROTECT;
+    return return_base_type(value, &prodesc);
+}
+
+static void
+pl_param_values(VALUE values, int nargs, Oid *argtypes, Datum *argvalues,
+                char *nulls)
+{
+    VALUE value;
+    int i;
+
+    for (i = 0; i < nargs; i++) {
+        value = rb_ary_entry(values, i);
+        if (NIL_P(value)) {
+            nulls[i] = 'n';
+            argvalues[i] = (Datum)0;
+        }
+        else {
+            nulls[i] = ' ';
+            argvalues[i] = pl_param_datum(value, argtypes[i]);
+        }
+    }
+    nulls[nargs] = '\0';
+}
+
+#endif
+
+/*
+ * run a prepared plan for exec, or open it as a cursor when rows are
+ * read by a block
+ */
+struct pl_exec_plan {
+    void *plan;
+    VALUE values;
+    Oid *argtypes;
+    Datum *argvalues;
+    char *nulls;
+    int nargs, count, cursor, rc;
+    Portal portal;
+};
+
+#if PG_PL_VERSION >= 81
+
+static VALUE
+pl_exec_plan(VALUE arg)
+{
+    struct pl_exec_plan *ep = (struct pl_exec_plan *)arg;
+#if PG_PL_VERSION >= 84
+    int i;
+
+    /* the values are converted to the types of the plan */
+    if (ep->nargs) {
+        PLRUBY_BEGIN_PROTECT(1);
+        for (i = 0; i < ep->nargs; i++) {
+            ep->argtypes[i] = SPI_getargtypeid(ep->plan, i);
+        }
+        PLRUBY_END_PROTECT;
+        pl_param_values(ep->values, ep->nargs, ep->argtypes, ep->argvalues,
+                        ep->nulls);
+    }
+#endif
+
+    PLRUBY_BEGIN_PROTECT(1);
+    if (ep->cursor && SPI_is_cursor_plan(ep->plan)) {
+        ep->portal = SPI_cursor_open(NULL, ep->plan, ep->argvalues,
+                                     ep->nulls, false);
     }
-    tmp = ALLOCA_N(char, RSTRING_LEN(mes) * 2 + 1);
-    cp1 = RSTRING_PTR(mes);
-    cp2 = tmp;
-    while (*cp1) {
-        if (*cp1 == '\'')
-            *cp2++ = '\'';
-        else {
-            if (*cp1 == '\\')
-                *cp2++ = '\\';
-        }
-        *cp2++ = *cp1++;
+    else {
+        ep->rc = SPI_execp(ep->plan, ep->argvalues, ep->nulls, ep->count);
     }
-    *cp2 = '\0';
-    return rb_tainted_str_new2(tmp);
+    PLRUBY_END_PROTECT;
+    return Qnil;
 }
 
-void
-plruby_exec_output(VALUE option, int compose, int *result)
+#endif
+
+/* "values" and "types" for exec, the other options are for plruby_i_each */
+static VALUE
+pl_exec_i_args(VALUE obj, VALUE *args)
 {
-    if (TYPE(option) != T_STRING || RSTRING_PTR(option) == 0 || !result) {
-        rb_raise(pl_ePLruby, "string expected for optional output");
-    }
-    if (strcmp(RSTRING_PTR(option), "array") == 0) {
-        *result = compose|RET_DESC_ARR;
-    }
-    else if (strcmp(RSTRING_PTR(option), "hash") == 0) {
-        *result = compose|RET_DESC;
+    VALUE key;
+
+    key = plruby_to_s(rb_ary_entry(obj, 0));
+    if (strcmp(RSTRING_PTR(key), "values") == 0) {
+        args[0] = rb_ary_entry(obj, 1);
     }
-    else if (strcmp(RSTRING_PTR(option), "value") == 0) {
-        *result = RET_ARRAY;
+    else if (strcmp(RSTRING_PTR(key), "types") == 0) {
+        args[1] = rb_ary_entry(obj, 1);
     }
+    return Qnil;
 }
 
 static VALUE
@@ -877,23 +1785,44 @@ pl_SPI_exec(argc, argv, obj)
     VALUE *argv;
     VALUE obj;
 {
-    int spi_rc, count, array;
-    int i, comp, ntuples;
+    int spi_rc, count, array, block;
+    int i, comp, ntuples, nargs;
     struct portal_options po;
-    VALUE a, b, c, result;
+    VALUE a, b, c, d, result;
+    VALUE params[2];
+    volatile VALUE meta;
     HeapTuple *tuples;
     TupleDesc tupdesc = NULL;
-
-    count = 0;
+    Oid *argtypes = NULL;
+    Datum *argvalues = NULL;
+    char *nulls = NULL;
+    struct pl_exec_plan ep;
+    void *entry = NULL;
+    int state;
+
+    count = block = nargs = 0;
+    params[0] = params[1] = Qnil;
     array = comp = RET_HASH;
     if (argc && TYPE(argv[argc - 1]) == T_HASH) {
         MEMZERO(&po, struct portal_options, 1);
         rb_iterate(rb_each, argv[argc - 1], plruby_i_each, (VALUE)&po);
+        rb_iterate(rb_each, argv[argc - 1], pl_exec_i_args, (VALUE)params);
         comp = po.output;
         count = po.count;
+        block = po.block;
+        argc--;
+    }
+    argc = rb_scan_args(argc, argv, "13", &a, &b, &c, &d);
+    if (argc > 1 && TYPE(b) == T_ARRAY) {
+        params[0] = b;
+        b = c;
+        c = d;
         argc--;
     }
-    switch (rb_scan_args(argc, argv, "12", &a, &b, &c)) {
+    else if (argc == 4) {
+        rb_raise(pl_ePLruby, "exec: second argument must be an Array");
+    }
+    switch (argc) {
     case 3:
         plruby_exec_output(c, RET_HASH, &comp);
         /* ... */
@@ -906,9 +1835,103 @@ pl_SPI_exec(argc, argv, obj)
         rb_raise(pl_ePLruby, "exec: first argument must be a string");
     }
     array = comp;
-    PLRUBY_BEGIN_PROTECT(1);
-    spi_rc = SPI_exec(RSTRING_PTR(a), count);
-    PLRUBY_END_PROTECT;
+    if (!NIL_P(params[0])) {
+#if PG_PL_VERSION >= 84
+        VALUE value, type = Qnil;
+
+        Check_Type(params[0], T_ARRAY);
+        nargs = RARRAY_LEN(params[0]);
+        if (!NIL_P(params[1])) {
+            Check_Type(params[1], T_ARRAY);
+            if (RARRAY_LEN(params[1]) != nargs) {
+                rb_raise(pl_ePLruby, "exec: %d types given for %d values",
+                         (int)RARRAY_LEN(params[1]), nargs);
+            }
+        }
+        argtypes = ALLOCA_N(Oid, nargs + 1);
+        argvalues = ALLOCA_N(Datum, nargs + 1);
+        nulls = ALLOCA_N(char, nargs + 1);
+        for (i = 0; i < nargs; i++) {
+            value = rb_ary_entry(params[0], i);
+            if (!NIL_P(params[1])) {
+                type = rb_ary_entry(params[1], i);
+            }
+            argtypes[i] = pl_param_type(type, value);
+        }
+#else
+        rb_raise(pl_ePLruby, "exec: values need PostgreSQL >= 8.4");
+#endif
+    }
+    plruby_spi_connect();
+    MEMZERO(&ep, struct pl_exec_plan, 1);
+    ep.values = params[0];
+    ep.nargs = nargs;
+    ep.argtypes = argtypes;
+    ep.argvalues = argvalues;
+    ep.nulls = nulls;
+    ep.count = count;
+#if PG_PL_VERSION >= 81
+    ep.cursor = rb_block_given_p() && count != 1 && !(array & RET_COLUMNS);
+#endif
+#if PG_PL_VERSION >= 84
+    if (nargs && (ep.plan = plruby_plan_cached(RSTRING_PTR(a), nargs, 
+                                               argtypes, &entry))) {
+        rb_protect(pl_exec_plan, (VALUE)&ep, &state);
+        if (state || !ep.portal) {
+            plruby_plan_release(entry);
+            entry = NULL;
+        }
+        if (state) {
+            rb_jump_tag(state);
+        }
+    }
+    else
+#endif
+#if PG_PL_VERSION >= 81
+    if (ep.cursor) {
+        plruby_plan_types(RSTRING_PTR(a), nargs, argtypes);
+        PLRUBY_BEGIN_PROTECT(1);
+        ep.plan = SPI_prepare(RSTRING_PTR(a), nargs, argtypes);
+        if (ep.plan == NULL) {
+            elog(ERROR, "SPI_prepare() failed - %d", SPI_result);
+        }
+        PLRUBY_END_PROTECT;
+        pl_exec_plan((VALUE)&ep);
+        PLRUBY_BEGIN_PROTECT(1);
+        SPI_freeplan(ep.plan);
+        PLRUBY_END_PROTECT;
+    }
+    else
+#endif
+#if PG_PL_VERSION >= 84
+    if (nargs) {
+        plruby_plan_types(RSTRING_PTR(a), nargs, argtypes);
+        pl_param_values(params[0], nargs, argtypes, argvalues, nulls);
+        PLRUBY_BEGIN_PROTECT(1);
+        ep.rc = SPI_execute_with_args(RSTRING_PTR(a), nargs, argtypes,
+                                      argvalues, nulls, false, count);
+        PLRUBY_END_PROTECT;
+    }
+    else
+#endif
+    {
+        PLRUBY_BEGIN_PROTECT(1);
+        ep.rc = SPI_exec(RSTRING_PTR(a), count);
+        PLRUBY_END_PROTECT;
+    }
+#if PG_PL_VERSION >= 81
+    if (ep.portal) {
+        struct pl_exec_stream st;
+
+        st.portal = ep.portal;
+        st.entry = entry;
+        st.count = count;
+        st.block = (block > 0)?block:PL_EXEC_BLOCK;
+        st.output = array;
+        return rb_ensure(pl_exec_fetch, (VALUE)&st, pl_exec_close, (VALUE)&st);
+    }
+#endif
+    spi_rc = ep.rc;
 
     switch (spi_rc) {
     case SPI_OK_UTILITY:
@@ -946,6 +1969,15 @@ pl_SPI_exec(argc, argv, obj)
         rb_raise(pl_ePLruby, "SPI_exec() failed - unknown RC %d", spi_rc);
     }
 
+    if (array & RET_COLUMNS) {
+        result = plruby_build_columns(SPI_tuptable, SPI_processed, array);
+        SPI_freetuptable(SPI_tuptable);
+        if (rb_block_given_p()) {
+            rb_yield(result);
+            return Qtrue;
+        }
+        return result;
+    }
     ntuples = SPI_processed;
     if (ntuples <= 0) {
         SPI_freetuptable(SPI_tuptable);
@@ -964,9 +1996,17 @@ pl_SPI_exec(argc, argv, obj)
             plruby_build_tuple(tuples[0], tupdesc, array);
         }
         else {
+            /* converted first : the block can leave SPI */
+            meta = plruby_tuple_meta(tupdesc);
+            result = rb_ary_new2(ntuples);
             for (i = 0; i < ntuples; i++) {
-                rb_yield(plruby_build_tuple(tuples[i], tupdesc, array));
+                rb_ary_push(result, plruby_build_tuple_meta(tuples[i], meta, array));
             }
+            SPI_freetuptable(SPI_tuptable);
+            for (i = 0; i < ntuples; i++) {
+                rb_yield(RARRAY_PTR(result)[i]);
+            }
+            return Qtrue;
         }
         result = Qtrue;
     }
@@ -975,9 +2015,10 @@ pl_SPI_exec(argc, argv, obj)
             result = plruby_build_tuple(tuples[0], tupdesc, array);
         }
         else {
+            meta = plruby_tuple_meta(tupdesc);
             result = rb_ary_new2(ntuples);
             for (i = 0; i < ntuples; i++) {
-                rb_ary_push(result, plruby_build_tuple(tuples[i], tupdesc, array));
+                rb_ary_push(result, plruby_build_tuple_meta(tuples[i], meta, array));
             }
         }
     }
@@ -997,20 +2038,9 @@ pl_convert_arg(Datum value, Oid typoid, FmgrInfo *finfo, Oid typelem,
     }
 #ifdef PLRUBY_ENABLE_CONVERSION
     {
-        VALUE vid, klass;
-
-        vid = INT2NUM(typoid);
-        klass = rb_hash_aref(plruby_classes, vid);
-        if (NIL_P(klass)) {
-            klass = rb_hash_aref(plruby_conversions, vid);
-            if (NIL_P(klass)) {
-                st_insert(RHASH_TBL(plruby_classes), vid, Qfalse);
-            }
-            else {
-                klass = rb_const_get(rb_cObject, NUM2INT(klass));
-                st_insert(RHASH_TBL(plruby_classes), vid, klass);
-            }
-        }
+        VALUE klass;
+
+        klass = pl_conversion_class(typoid);
         if (RTEST(klass)) {
             struct datum_value *dv;
             VALUE res;
@@ -1035,12 +2065,20 @@ pl_convert_arg(Datum value, Oid typoid, FmgrInfo *finfo, Oid typelem,
     return result;
 }
 
+VALUE
+plruby_convert_arg(Datum value, Oid typoid, FmgrInfo *finfo, Oid typelem,
+                   int attlen)
+{
+    return pl_convert_arg(value, typoid, finfo, typelem, attlen);
+}
+
 static VALUE
-create_array(index, ndim, dim, p, prodesc, curr, typoid)
-    int index, ndim, *dim, curr;
+create_array(index, ndim, dim, p, prodesc, curr, typoid, bitmap, nth)
+    int index, ndim, *dim, curr, *nth;
     Oid typoid;
     char **p;
     pl_proc_desc *prodesc;
+    bits8 *bitmap;
 {
     VALUE res, tmp;
     Datum itemvalue;
@@ -1049,6 +2087,12 @@ create_array(index, ndim, dim, p, prodesc, curr, typoid)
     res = rb_ary_new2(dim[index]);
     for (i = 0; i < dim[index]; ++i) {
         if (index == ndim - 1) {
+            if (bitmap && !(bitmap[*nth / 8] & (1 << (*nth % 8)))) {
+                ++*nth;
+                rb_ary_push(res, Qnil);
+                continue;
+            }
+            ++*nth;
             itemvalue = fetch_att(*p, prodesc->arg_val[curr], 
                                   prodesc->arg_len[curr]);
             tmp = pl_convert_arg(itemvalue, typoid,
@@ -1063,209 +2107,489 @@ create_array(index, ndim, dim, p, prodesc, curr, typoid)
             rb_ary_push(res, tmp); 
         }
         else {
-            for (i = 0; i < dim[index]; ++i) {
-                rb_ary_push(res, create_array(index + 1, ndim, dim, p, 
-                                              prodesc, curr, typoid));
-            }
+            rb_ary_push(res, create_array(index + 1, ndim, dim, p, 
+                                          prodesc, curr, typoid, bitmap, nth));
         }
     }
     return res;
 }
 
-VALUE
-plruby_build_tuple(HeapTuple tuple, TupleDesc tupdesc, int type_ret)
+/*
+ * What plruby_build_tuple needs to know about each column, computed
+ * once for a result and shared by all its rows
+ */
+struct pl_column {
+    Oid typoid;
+    Oid typelem;
+    int attlen;
+    int alen;
+    bool dropped;
+    bool has_output;
+    bool is_array;
+    bool elem_val;
+    int elem_len;
+    char elem_align;
+    FmgrInfo func;
+    plruby_arg_conv conv;
+    VALUE name;
+    VALUE sym;
+    VALUE typname;
+};
+
+struct pl_tuple_meta {
+    TupleDesc tupdesc;
+    int natts;
+    struct pl_column *cols;
+    Datum *values;
+#if PG_PL_VERSION >= 82
+    bool *nulls;
+#else
+    char *nulls;
+#endif
+};
+
+static void
+pl_meta_mark(struct pl_tuple_meta *meta)
 {
     int i;
-    VALUE output, res = Qnil;
-    Datum attr;
-    bool isnull;
-    char *attname;
+
+    if (!meta->cols) return;
+    for (i = 0; i < meta->natts; i++) {
+        rb_gc_mark(meta->cols[i].name);
+        rb_gc_mark(meta->cols[i].sym);
+        rb_gc_mark(meta->cols[i].typname);
+    }
+}
+
+static void
+pl_meta_free(struct pl_tuple_meta *meta)
+{
+    xfree(meta->cols);
+    xfree(meta->values);
+    xfree(meta->nulls);
+    xfree(meta);
+}
+
+/* frozen hash key shared by all the rows of a result */
+static VALUE
+pl_column_key(char *attname)
+{
+    VALUE name = rb_tainted_str_new2(attname);
+
+#ifdef HAVE_RB_STR_TO_INTERNED_STR
+    return rb_str_to_interned_str(name);
+#else
+    OBJ_FREEZE(name);
+    return name;
+#endif
+}
+
+VALUE
+plruby_tuple_meta(TupleDesc tupdesc)
+{
+    VALUE res;
+    struct pl_tuple_meta *meta;
+    struct pl_column *col;
     HeapTuple typeTup;
-    Oid typoutput;
-    Oid typelem;
     Form_pg_type fpgt;
-    
-    output = Qnil;
-    if (type_ret & RET_ARRAY) {
-        output = rb_ary_new();
-    }
-    else if (type_ret & RET_HASH) {
-        output = rb_hash_new();
-    }
-    if (!tuple) {
-        return output;
-    }
+    Oid typoutput;
+    NameData typname;
+    int i;
 
-    for (i = 0; i < tupdesc->natts; i++) {
-        if (tupdesc->attrs[i]->attisdropped)
+    res = Data_Make_Struct(rb_cData, struct pl_tuple_meta, pl_meta_mark,
+                           pl_meta_free, meta);
+    meta->tupdesc = tupdesc;
+    meta->natts = tupdesc->natts;
+    meta->values = ALLOC_N(Datum, meta->natts + 1);
+#if PG_PL_VERSION >= 82
+    meta->nulls = ALLOC_N(bool, meta->natts + 1);
+#else
+    meta->nulls = ALLOC_N(char, meta->natts + 1);
+#endif
+    col = ALLOC_N(struct pl_column, meta->natts + 1);
+    MEMZERO(col, struct pl_column, meta->natts + 1);
+    meta->cols = col;
+
+    for (i = 0; i < meta->natts; i++, col++) {
+        col->name = col->sym = col->typname = Qnil;
+        if (tupdesc->attrs[i]->attisdropped) {
+            col->dropped = true;
             continue;
+        }
+        col->typoid = tupdesc->attrs[i]->atttypid;
+        col->attlen = tupdesc->attrs[i]->attlen;
+
         PLRUBY_BEGIN(1);
-        attname = NameStr(tupdesc->attrs[i]->attname);
-        attr = heap_getattr(tuple, i + 1, tupdesc, &isnull);
-        typeTup = SearchSysCache(TYPEOID, OidGD(tupdesc->attrs[i]->atttypid),
-                                 0, 0, 0);
+        typeTup = SearchSysCache(TYPEOID, OidGD(col->typoid), 0, 0, 0);
         PLRUBY_END;
-
         if (!HeapTupleIsValid(typeTup)) {
             rb_raise(pl_ePLruby, "Cache lookup for attribute '%s' type %ld failed",
-                     attname, OidGD(tupdesc->attrs[i]->atttypid));
+                     NameStr(tupdesc->attrs[i]->attname), OidGD(col->typoid));
         }
-
         fpgt = (Form_pg_type) GETSTRUCT(typeTup);
         typoutput = (Oid) (fpgt->typoutput);
 #if PG_PL_VERSION >= 75
-        typelem = getTypeIOParam(typeTup);
+        col->typelem = getTypeIOParam(typeTup);
 #else
-        typelem = (Oid) (fpgt->typelem);
+        col->typelem = (Oid) (fpgt->typelem);
 #endif
-        if (type_ret & RET_DESC) {
-            Oid typeid;
-            char *typname;
-            int alen;
-
-            typname = NameStr(fpgt->typname);
-            alen = tupdesc->attrs[i]->attlen;
-            typeid = tupdesc->attrs[i]->atttypid;
-            if (strcmp(typname, "text") == 0) {
-                alen = -1;
+        typname = fpgt->typname;
+        ReleaseSysCache(typeTup);
+
+        col->name = pl_column_key(NameStr(tupdesc->attrs[i]->attname));
+        col->typname = rb_tainted_str_new2(NameStr(typname));
+        OBJ_FREEZE(col->typname);
+        col->alen = col->attlen;
+        if (strcmp(NameStr(typname), "text") == 0) {
+            col->alen = -1;
+        }
+        else if (strcmp(NameStr(typname), "bpchar") == 0 ||
+                 strcmp(NameStr(typname), "varchar") == 0) {
+            if (tupdesc->attrs[i]->atttypmod == -1) {
+                col->alen = 0;
             }
-            else if (strcmp(typname, "bpchar") == 0 ||
-                     strcmp(typname, "varchar") == 0) {
-                if (tupdesc->attrs[i]->atttypmod == -1) {
-                    alen = 0;
-                }
-                else {
-                    alen = tupdesc->attrs[i]->atttypmod - 4;
-                }
+            else {
+                col->alen = tupdesc->attrs[i]->atttypmod - 4;
+            }
+        }
+
+        col->has_output = OidIsValid(typoutput);
+        if (!col->has_output) {
+            continue;
+        }
+        col->is_array = NameStr(typname)[0] == '_';
+        if (col->is_array) {
+            HeapTuple typeTuple;
+            Form_pg_type typeStruct;
+
+            PLRUBY_BEGIN_PROTECT(1);
+            typeTuple = SearchSysCache(TYPEOID, OidGD(col->typelem), 0, 0, 0);
+            if (!HeapTupleIsValid(typeTuple)) {
+                elog(ERROR, "cache lookup failed for type %u", col->typelem);
             }
+            typeStruct = (Form_pg_type) GETSTRUCT(typeTuple);
+            fmgr_info(typeStruct->typoutput, &col->func);
+            col->elem_val = typeStruct->typbyval;
+            col->elem_len = typeStruct->typlen;
+            col->elem_align = typeStruct->typalign;
+            ReleaseSysCache(typeTuple);
+            PLRUBY_END_PROTECT;
+        }
+        else {
+            PLRUBY_BEGIN_PROTECT(1);
+            fmgr_info(typoutput, &col->func);
+            PLRUBY_END_PROTECT;
+            col->conv = plruby_arg_converter(col->typoid);
+        }
+    }
+    return res;
+}
+
+static VALUE
+pl_column_value(struct pl_column *col, Datum attr)
+{
+    ArrayType *array;
+    int ndim, *dim, nitems;
+
+    if (col->conv) {
+        return col->conv(attr);
+    }
+    if (!col->is_array) {
+        return pl_convert_arg(attr, col->typoid, &col->func, col->typelem,
+                              col->attlen);
+    }
+    PLRUBY_BEGIN_PROTECT(1);
+    array = DatumGetArrayTypeP(attr);
+    ndim = ARR_NDIM(array);
+    dim = ARR_DIMS(array);
+    nitems = ArrayGetNItems(ndim, dim);
+    PLRUBY_END_PROTECT;
+    if (nitems == 0) {
+        return rb_ary_new2(0);
+    }
+    else {
+        pl_proc_desc prodesc;
+        char *p = ARR_DATA_PTR(array);
+        int nth = 0;
+
+        prodesc.arg_func[0] = col->func;
+        prodesc.arg_val[0] = col->elem_val;
+        prodesc.arg_len[0] = col->elem_len;
+        prodesc.arg_align[0] = col->elem_align;
+        return create_array(0, ndim, dim, &p, &prodesc, 0, 
+                            ARR_ELEMTYPE(array), PL_ARR_NULLBITMAP(array),
+                            &nth);
+    }
+}
+
+static void
+pl_meta_deform(struct pl_tuple_meta *meta, HeapTuple tuple)
+{
+    PLRUBY_BEGIN_PROTECT(1);
+#if PG_PL_VERSION >= 82
+    heap_deform_tuple(tuple, meta->tupdesc, meta->values, meta->nulls);
+#else
+    heap_deformtuple(tuple, meta->tupdesc, meta->values, meta->nulls);
+#endif
+    PLRUBY_END_PROTECT;
+}
+
+#if PG_PL_VERSION >= 82
+#define PL_META_NULL(meta, i) ((meta)->nulls[i])
+#else
+#define PL_META_NULL(meta, i) ((meta)->nulls[i] == 'n')
+#endif
+
+VALUE
+plruby_build_tuple_meta(HeapTuple tuple, VALUE vmeta, int type_ret)
+{
+    struct pl_tuple_meta *meta;
+    struct pl_column *col;
+    VALUE output, res = Qnil, s;
+    int i;
+    
+    output = Qnil;
+    if (type_ret & RET_ARRAY) {
+        output = rb_ary_new();
+    }
+    else if (type_ret & RET_HASH) {
+        output = rb_hash_new();
+    }
+    if (!tuple) {
+        return output;
+    }
+    Data_Get_Struct(vmeta, struct pl_tuple_meta, meta);
+    pl_meta_deform(meta, tuple);
+
+    for (i = 0, col = meta->cols; i < meta->natts; i++, col++) {
+        if (col->dropped)
+            continue;
+        if (type_ret & RET_DESC) {
             if ((type_ret & RET_DESC_ARR) == RET_DESC_ARR) {
                 res = rb_ary_new();
-                rb_ary_push(res, rb_tainted_str_new2(attname));
+                rb_ary_push(res, rb_str_dup(col->name));
                 rb_ary_push(res, Qnil);
-                rb_ary_push(res, rb_tainted_str_new2(typname));
-                rb_ary_push(res, INT2FIX(alen));
-                rb_ary_push(res, INT2FIX(typeid));
+                rb_ary_push(res, rb_str_dup(col->typname));
+                rb_ary_push(res, INT2FIX(col->alen));
+                rb_ary_push(res, INT2FIX(col->typoid));
             }
             else {
                 res = rb_hash_new();
-                rb_hash_aset(res, rb_tainted_str_new2("name"), rb_tainted_str_new2(attname));
-                rb_hash_aset(res, rb_tainted_str_new2("type"), rb_tainted_str_new2(typname));
-                rb_hash_aset(res, rb_tainted_str_new2("typeid"), INT2FIX(typeid));
-                rb_hash_aset(res, rb_tainted_str_new2("len"), INT2FIX(alen));
+                rb_hash_aset(res, rb_tainted_str_new2("name"), rb_str_dup(col->name));
+                rb_hash_aset(res, rb_tainted_str_new2("type"), rb_str_dup(col->typname));
+                rb_hash_aset(res, rb_tainted_str_new2("typeid"), INT2FIX(col->typoid));
+                rb_hash_aset(res, rb_tainted_str_new2("len"), INT2FIX(col->alen));
             }
         }
-        ReleaseSysCache(typeTup);
-        if (!isnull && OidIsValid(typoutput)) {
-            VALUE s;
-
-            PLRUBY_BEGIN_PROTECT(1);
-            if (NameStr(fpgt->typname)[0] == '_') {
-                ArrayType *array;
-                int ndim, *dim;
-                
-                array = (ArrayType *)attr;
-                ndim = ARR_NDIM(array);
-                dim = ARR_DIMS(array);
-                if (ArrayGetNItems(ndim, dim) == 0) {
-                    s = rb_ary_new2(0);
+        if (PL_META_NULL(meta, i)) {
+            s = Qnil;
+        }
+        else if (col->has_output) {
+            s = pl_column_value(col, meta->values[i]);
+        }
+        else {
+            continue;
+        }
+        if (type_ret & RET_DESC) {
+            if (TYPE(res) == T_ARRAY) {
+                rb_ary_store(res, 1, s);
+            }
+            else {
+                rb_hash_aset(res, rb_tainted_str_new2("value"), s);
+            }
+            if (TYPE(output) == T_ARRAY) {
+                rb_ary_push(output, res);
+            }
+            else {
+                rb_yield(res);
+            }
+        }
+        else if (type_ret & RET_BASIC) {
+            rb_yield(rb_assoc_new(rb_str_dup(col->name), s));
+        }
+        else {
+            switch (TYPE(output)) {
+            case T_HASH:
+                if (type_ret & RET_SYMBOL) {
+                    if (NIL_P(col->sym)) {
+                        col->sym = rb_str_intern(col->name);
+                    }
+                    rb_hash_aset(output, col->sym, s);
                 }
                 else {
-                    pl_proc_desc prodesc;
-                    HeapTuple typeTuple;
-                    Form_pg_type typeStruct;
-                    Oid elemtyp;
-                    char *p = ARR_DATA_PTR(array);
-
-                    typeTuple = 
-                        SearchSysCache(TYPEOID, OidGD(typelem), 0, 0, 0);
-                    if (!HeapTupleIsValid(typeTuple)) {
-                        elog(ERROR, "cache lookup failed for type %u",
-                             typelem);
-                    }
+                    rb_hash_aset(output, col->name, s);
+                }
+                break;
+            case T_ARRAY:
+                rb_ary_push(output, s);
+                break;
+            }
+        }
+    }
+    return output;
+}
+
+/* size of an element of a column returned packed by "packed_columns" */
+static int
+pl_packed_size(Oid typoid)
+{
+    switch (typoid) {
+    case INT2OID:
+        return sizeof(int16);
+    case INT4OID:
+        return sizeof(int32);
+    case INT8OID:
+        return sizeof(int64);
+    case FLOAT4OID:
+        return sizeof(float4);
+    case FLOAT8OID:
+        return sizeof(float8);
+    }
+    return 0;
+}
+
+static void
+pl_packed_store(Oid typoid, char *p, Datum value)
+{
+    int16 i2;
+    int32 i4;
+    int64 i8;
+    float4 f4;
+    float8 f8;
+
+    switch (typoid) {
+    case INT2OID:
+        i2 = DatumGetInt16(value);
+        memcpy(p, &i2, sizeof(i2));
+        break;
+    case INT4OID:
+        i4 = DatumGetInt32(value);
+        memcpy(p, &i4, sizeof(i4));
+        break;
+    case INT8OID:
+        i8 = DatumGetInt64(value);
+        memcpy(p, &i8, sizeof(i8));
+        break;
+    case FLOAT4OID:
+        f4 = DatumGetFloat4(value);
+        memcpy(p, &f4, sizeof(f4));
+        break;
+    case FLOAT8OID:
+        f8 = DatumGetFloat8(value);
+        memcpy(p, &f8, sizeof(f8));
+        break;
+    }
+}
 
-                    typeStruct = (Form_pg_type) GETSTRUCT(typeTuple);
+/* a NULL was found : give back the first n elements as an Array */
+static VALUE
+pl_packed_unpack(Oid typoid, VALUE str, int n, int size)
+{
+    VALUE res;
+    char *p;
+    int16 i2;
+    int32 i4;
+    int64 i8;
+    float4 f4;
+    float8 f8;
+    int i;
 
-                    fmgr_info(typeStruct->typoutput, &(prodesc.arg_func[0]));
-                    prodesc.arg_val[0] = typeStruct->typbyval;
-                    prodesc.arg_len[0] = typeStruct->typlen;
-                    prodesc.arg_align[0] = typeStruct->typalign;
-                    elemtyp = ARR_ELEMTYPE(array);
-                    ReleaseSysCache(typeTuple);
-                    s = create_array(0, ndim, dim, &p, &prodesc, 0, elemtyp); 
-                }
-            }
-            else {
-                FmgrInfo finfo;
-                
-                fmgr_info(typoutput, &finfo);
-                
-                s = pl_convert_arg(attr, tupdesc->attrs[i]->atttypid,
-                                   &finfo, typelem,tupdesc->attrs[i]->attlen);
-            }
-            PLRUBY_END_PROTECT;
+    res = rb_ary_new2(n);
+    for (i = 0, p = RSTRING_PTR(str); i < n; i++, p += size) {
+        switch (typoid) {
+        case INT2OID:
+            memcpy(&i2, p, sizeof(i2));
+            rb_ary_push(res, INT2FIX(i2));
+            break;
+        case INT4OID:
+            memcpy(&i4, p, sizeof(i4));
+            rb_ary_push(res, INT2NUM(i4));
+            break;
+        case INT8OID:
+            memcpy(&i8, p, sizeof(i8));
+            rb_ary_push(res, LL2NUM(i8));
+            break;
+        case FLOAT4OID:
+            memcpy(&f4, p, sizeof(f4));
+            rb_ary_push(res, rb_float_new(f4));
+            break;
+        case FLOAT8OID:
+            memcpy(&f8, p, sizeof(f8));
+            rb_ary_push(res, rb_float_new(f8));
+            break;
+        }
+    }
+    return res;
+}
 
-            if (type_ret & RET_DESC) {
-                if (TYPE(res) == T_ARRAY) {
-                    RARRAY_PTR(res)[1] = s;
-                }
-                else {
-                    rb_hash_aset(res, rb_tainted_str_new2("value"), s);
-                }
-                if (TYPE(output) == T_ARRAY) {
-                    rb_ary_push(output, res);
-                }
-                else {
-                    rb_yield(res);
+VALUE
+plruby_build_columns(SPITupleTable *tuptab, int ntuples, int type_ret)
+{
+    struct pl_tuple_meta *meta;
+    struct pl_column *col;
+    volatile VALUE vmeta, acc;
+    VALUE res, column;
+    int i, j, *packed;
+
+    vmeta = plruby_tuple_meta(tuptab->tupdesc);
+    Data_Get_Struct(vmeta, struct pl_tuple_meta, meta);
+    packed = ALLOCA_N(int, meta->natts + 1);
+    acc = rb_ary_new2(meta->natts);
+    for (i = 0, col = meta->cols; i < meta->natts; i++, col++) {
+        packed[i] = 0;
+        if ((type_ret & RET_PACKED) && !col->dropped && col->has_output) {
+            packed[i] = pl_packed_size(col->typoid);
+        }
+        if (packed[i]) {
+            rb_ary_push(acc, rb_tainted_str_new(0, ntuples * packed[i]));
+        }
+        else {
+            rb_ary_push(acc, rb_ary_new2(ntuples));
+        }
+    }
+    for (j = 0; j < ntuples; j++) {
+        pl_meta_deform(meta, tuptab->vals[j]);
+        for (i = 0, col = meta->cols; i < meta->natts; i++, col++) {
+            if (col->dropped || !col->has_output)
+                continue;
+            column = rb_ary_entry(acc, i);
+            if (PL_META_NULL(meta, i)) {
+                if (packed[i]) {
+                    column = pl_packed_unpack(col->typoid, column, j, packed[i]);
+                    rb_ary_store(acc, i, column);
+                    packed[i] = 0;
                 }
+                rb_ary_push(column, Qnil);
             }
-            else {
-                if (type_ret & RET_BASIC) {
-                    rb_yield(rb_assoc_new(rb_tainted_str_new2(attname), s));
-                }
-                else {
-                    switch (TYPE(output)) {
-                    case T_HASH:
-                        rb_hash_aset(output, rb_tainted_str_new2(attname), s);
-                        break;
-                    case T_ARRAY:
-                        rb_ary_push(output, s);
-                        break;
-                    }
-                }
+            else if (packed[i]) {
+                pl_packed_store(col->typoid, 
+                                RSTRING_PTR(column) + j * packed[i],
+                                meta->values[i]);
             }
-        } 
-        else {
-            if (isnull) {
-                if (type_ret & RET_DESC) {
-                    if (TYPE(res) == T_HASH) {
-                        rb_hash_aset(res, rb_tainted_str_new2("value"), Qnil);
-                    }                   
-                    if (TYPE(output) == T_ARRAY) {
-                        rb_ary_push(output, res);
-                    }
-                    else {
-                        rb_yield(res);
-                    }
-                }
-                else {
-                    if (type_ret & RET_BASIC) {
-                        rb_yield(rb_assoc_new(rb_tainted_str_new2(attname), Qnil));
-                    }
-                    else {
-                        switch (TYPE(output)) {
-                        case T_HASH:
-                            rb_hash_aset(output, rb_tainted_str_new2(attname), Qnil);
-                            break;
-                        case T_ARRAY:
-                            rb_ary_push(output, Qnil);
-                            break;
-                        }
-                    }    
-                }
+            else {
+                rb_ary_push(column, pl_column_value(col, meta->values[i]));
             }
         }
     }
-    return output;
+    res = rb_hash_new();
+    for (i = 0, col = meta->cols; i < meta->natts; i++, col++) {
+        if (col->dropped || !col->has_output)
+            continue;
+        rb_hash_aset(res, col->name, rb_ary_entry(acc, i));
+    }
+    return res;
+}
+
+VALUE
+plruby_build_tuple(HeapTuple tuple, TupleDesc tupdesc, int type_ret)
+{
+    volatile VALUE meta;
+
+    if (!tuple) {
+        return plruby_build_tuple_meta(tuple, Qnil, type_ret);
+    }
+    meta = plruby_tuple_meta(tupdesc);
+    return plruby_build_tuple_meta(tuple, meta, type_ret);
 }
 
 VALUE
@@ -1282,19 +2606,45 @@ plruby_create_args(struct pl_thread_st *plth, pl_proc_desc *prodesc)
 
         res = rb_thread_local_aref(rb_thread_current(), id_thr);
         if (NIL_P(res)) {
-            res = Data_Make_Struct(rb_cData, struct pl_tuple, pl_thr_mark, free, tpl);
+            /* one pl_tuple per call level, cleared for each call */
+            res = rb_ary_entry(pl_tuples, plruby_call_level());
+            if (NIL_P(res)) {
+                res = Data_Make_Struct(rb_cData, struct pl_tuple, pl_thr_mark,
+                                       free, tpl);
+                rb_ary_store(pl_tuples, plruby_call_level(), res);
+            }
+            GetTuple(res, tpl);
+            MEMZERO(tpl, struct pl_tuple, 1);
+            rb_thread_local_aset(rb_thread_current(), id_thr, res);
         } 
         GetTuple(res, tpl);
         tpl->fcinfo = fcinfo;
         tpl->pro = prodesc;
-        rb_thread_local_aset(rb_thread_current(), id_thr, res);
+        tpl->emit = 0;
     }
 
+#if PG_PL_VERSION >= 75
+    /*
+     * named arguments are given one by one to the method : the array is
+     * never seen by the function and is reused for a scalar result
+     */
+    if (prodesc->named_args && !prodesc->result_type) {
+        if (!prodesc->args) {
+            prodesc->args = rb_ary_new2(prodesc->nargs);
+        }
+        ary = prodesc->args;
+        rb_ary_clear(ary);
+    }
+    else
+#endif
     ary = rb_ary_new2(prodesc->nargs);
     for (i = 0; i < prodesc->nargs; i++) {
         if (fcinfo->argnull[i]) {
             rb_ary_push(ary, Qnil);
         }
+        else if (prodesc->arg_conv[i]) {
+            rb_ary_push(ary, prodesc->arg_conv[i](fcinfo->arg[i]));
+        }
         else if (prodesc->arg_is_rel[i]) {
             VALUE tmp;
 
@@ -1322,10 +2672,12 @@ plruby_create_args(struct pl_thread_st *plth, pl_proc_desc *prodesc)
         } 
         else if (prodesc->arg_is_array[i]) {
             ArrayType *array;
-            int ndim, *dim;
+            int ndim, *dim, nth = 0;
             char *p;
 
-            array = (ArrayType *)fcinfo->arg[i];
+            PLRUBY_BEGIN_PROTECT(1);
+            array = DatumGetArrayTypeP(fcinfo->arg[i]);
+            PLRUBY_END_PROTECT;
             ndim = ARR_NDIM(array);
             dim = ARR_DIMS(array);
             if (ArrayGetNItems(ndim, dim) == 0) {
@@ -1336,7 +2688,8 @@ plruby_create_args(struct pl_thread_st *plth, pl_proc_desc *prodesc)
                 elemtyp = ARR_ELEMTYPE(array);
                 p = ARR_DATA_PTR(array);
                 rb_ary_push(ary, create_array(0, ndim, dim, &p, prodesc, i,
-                                              elemtyp));
+                                              elemtyp, PL_ARR_NULLBITMAP(array),
+                                              &nth));
             }
         }
         else {
@@ -1353,9 +2706,429 @@ plruby_create_args(struct pl_thread_st *plth, pl_proc_desc *prodesc)
     return ary;
 }
 
+/*
+ * The row type of a SETOF function : a function returning a base type
+ * gives rows of one column
+ */
+static TupleDesc
+pl_srf_desc(PG_FUNCTION_ARGS, int *scalar)
+{
+    TupleDesc tupdesc;
+    Oid rettype;
+
+    switch (get_call_result_type(fcinfo, &rettype, &tupdesc)) {
+    case TYPEFUNC_COMPOSITE:
+        *scalar = 0;
+        break;
+    case TYPEFUNC_SCALAR:
+        tupdesc = CreateTemplateTupleDesc(1, false);
+        TupleDescInitEntry(tupdesc, (AttrNumber)1, "value", rettype, -1, 0);
+        *scalar = 1;
+        break;
+    default:
+        ereport(ERROR,
+                (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                 errmsg("function returning record called in context "
+                        "that cannot accept type record")));
+    }
+    return tupdesc;
+}
+
+#ifndef PL_SRF_FIBER
+
+/*
+ * Without Fiber the rows go to a tuplestore, which spills to disk past
+ * work_mem, and are given to the executor in materialize mode
+ */
+static void
+pl_srf_materialize(PG_FUNCTION_ARGS, pl_proc_desc *prodesc, VALUE ary)
+{
+    ReturnSetInfo *rsi = (ReturnSetInfo *)fcinfo->resultinfo;
+    MemoryContext oldcxt;
+    TupleDesc tupdesc;
+    struct pl_tuple *tpl;
+    struct pl_arg *args;
+    VALUE tuple, arg;
+    int scalar;
+
+    tuple = rb_thread_local_aref(rb_thread_current(), id_thr);
+    if (NIL_P(tuple)) {
+        tuple = Data_Make_Struct(rb_cData, struct pl_tuple, pl_thr_mark, 
+                                 free, tpl);
+        rb_thread_local_aset(rb_thread_current(), id_thr, tuple);
+    }
+    GetTuple(tuple, tpl);
+    PLRUBY_BEGIN_PROTECT(1);
+    tupdesc = pl_srf_desc(fcinfo, &scalar);
+    PLRUBY_END_PROTECT;
+    /* the descriptor and the conversions are kept for the query */
+    tpl->outm = pl_out_meta_cached(fcinfo, tupdesc);
+    if (tpl->outm) {
+        tupdesc = tpl->outm->dsc;
+        tpl->att = tpl->outm->att;
+    }
+    else {
+        PLRUBY_BEGIN_PROTECT(1);
+        oldcxt = MemoryContextSwitchTo(rsi->econtext->ecxt_per_query_memory);
+        tupdesc = CreateTupleDescCopy(tupdesc);
+        tpl->att = TupleDescGetAttInMetadata(tupdesc);
+        MemoryContextSwitchTo(oldcxt);
+        PLRUBY_END_PROTECT;
+    }
+    tpl->cxt = rsi->econtext->ecxt_per_query_memory;
+    tpl->dsc = tupdesc;
+    tpl->pro = prodesc;
+    tpl->out = NULL;
+    tpl->emit = PL_EMIT_STORE;
+
+    arg = Data_Make_Struct(rb_cObject, struct pl_arg, pl_arg_mark, free, args);
+    args->pro = prodesc;
+    args->ary = ary;
+#if PG_PL_VERSION >= 75
+    args->named = prodesc->named_args;
+#endif
+#if HAVE_RB_BLOCK_CALL
+    if (args->named) {
+        rb_block_call(prodesc->method, id_call, RARRAY_LEN(args->ary),
+                      RARRAY_PTR(args->ary), pl_tuple_put, tuple);
+    }
+    else {
+        rb_block_call(prodesc->method, id_call, 1, &args->ary,
+                      pl_tuple_put, tuple);
+    }
+#else
+    rb_iterate(pl_func, arg, pl_tuple_put, tuple);
+#endif
+    tpl->emit = 0;
+
+    PLRUBY_BEGIN_PROTECT(1);
+    oldcxt = MemoryContextSwitchTo(tpl->cxt);
+    if (!tpl->out) {
+#if PG_PL_VERSION >= 74
+        tpl->out = tuplestore_begin_heap(true, false, SortMem);
+#else
+        tpl->out = tuplestore_begin_heap(true, SortMem);
+#endif
+    }
+    tuplestore_donestoring(tpl->out);
+    MemoryContextSwitchTo(oldcxt);
+    PLRUBY_END_PROTECT;
+    rsi->setResult = tpl->out;
+    rsi->setDesc = tupdesc;
+    rsi->returnMode = SFRM_Materialize;
+}
+
+#else
+
+/*
+ * ValuePerCall : the function runs in a Fiber, resumed once per row
+ * asked by the executor. An entry of pl_srf_states keeps the Fiber, the
+ * tuple, the arguments and the descriptor alive until the scan ends or
+ * the subtransaction which started it aborts. SPI is finished after
+ * each row : nothing read from SPI is held across a yield (see
+ * pl_exec_fetch)
+ */
+
+static VALUE pl_srf_states, pl_srf_done, pl_srf_batch;
+static int pl_srf_count;
+
+struct pl_srf {
+    VALUE key;
+    VALUE fiber;
+    VALUE tuple;
+    VALUE batch;
+    long pos;
+    int scalar;
+};
+
+/* PL.emit_rows yields [pl_srf_batch, rows] : one Fiber switch per batch */
+#define PL_SRF_BATCH_P(row_)                                            \
+    (TYPE(row_) == T_ARRAY && RARRAY_LEN(row_) == 2 &&                 \
+     RARRAY_PTR(row_)[0] == pl_srf_batch)
+
+/*
+ * check_stack_depth() must measure the Fiber stack while the Fiber
+ * runs, and the stack which resumed it otherwise
+ */
+static void
+pl_srf_enter(VALUE thr)
+{
+    struct pl_tuple *tpl;
+
+    /* thread local variables are local to the Fiber */
+    rb_thread_local_aset(rb_thread_current(), id_thr, thr);
+    GetTuple(thr, tpl);
+    tpl->base = set_stack_base();
+}
+
+static VALUE
+pl_srf_leave(VALUE thr)
+{
+    struct pl_tuple *tpl;
+
+    GetTuple(thr, tpl);
+    restore_stack_base(tpl->base);
+    return Qnil;
+}
+
+static VALUE
+pl_srf_yield(VALUE row, VALUE arg)
+{
+    VALUE thr;
+
+    thr = rb_thread_local_aref(rb_thread_current(), id_thr);
+    pl_srf_leave(thr);
+    thr = rb_fiber_yield(1, &row);
+    pl_srf_enter(thr);
+    return Qnil;
+}
+
+static VALUE
+pl_srf_call(VALUE arg)
+{
+    struct pl_arg *args;
+
+    Data_Get_Struct(arg, struct pl_arg, args);
+    if (args->named) {
+        rb_block_call(args->pro->method, id_call, RARRAY_LEN(args->ary),
+                      RARRAY_PTR(args->ary), pl_srf_yield, Qnil);
+    }
+    else {
+        rb_block_call(args->pro->method, id_call, 1, &args->ary,
+                      pl_srf_yield, Qnil);
+    }
+    return pl_srf_done;
+}
+
+static VALUE
+pl_srf_body(VALUE thr, VALUE arg)
+{
+    pl_srf_enter(thr);
+    return rb_ensure(pl_srf_call, arg, pl_srf_leave, thr);
+}
+
+static VALUE
+pl_srf_resume(VALUE arg)
+{
+    struct pl_srf *srf = (struct pl_srf *)arg;
+
+    return rb_fiber_resume(srf->fiber, 1, &srf->tuple);
+}
+
+static void
+pl_srf_shutdown(Datum key)
+{
+    rb_hash_delete(pl_srf_states, INT2NUM(DatumGetInt32(key)));
+}
+
+/* an ExprContext callback isn't called when a query fails */
+static int
+pl_srf_i_abort(VALUE key, VALUE value, VALUE subid)
+{
+    if (NIL_P(subid) || rb_equal(rb_ary_entry(value, 5), subid)) {
+        return ST_DELETE;
+    }
+    return ST_CONTINUE;
+}
+
+static void
+pl_srf_xact(XactEvent event, void *arg)
+{
+    if (event == XACT_EVENT_ABORT) {
+        rb_hash_foreach(pl_srf_states, pl_srf_i_abort, Qnil);
+    }
+}
+
+static void
+pl_srf_subxact(SubXactEvent event, SubTransactionId mySubid,
+               SubTransactionId parentSubid, void *arg)
+{
+    if (event == SUBXACT_EVENT_ABORT_SUB) {
+        rb_hash_foreach(pl_srf_states, pl_srf_i_abort, UINT2NUM(mySubid));
+    }
+}
+
+static Datum
+pl_srf_value_per_call(PG_FUNCTION_ARGS, VALUE proc, pl_proc_desc *prodesc,
+                      VALUE ary)
+{
+    FuncCallContext *funcctx;
+    struct pl_srf *srf;
+    struct pl_tuple *tpl;
+    HeapTuple tuple;
+    VALUE row;
+    int state;
+    Datum result;
+
+    if (SRF_IS_FIRSTCALL()) {
+        MemoryContext oldcontext;
+        ReturnSetInfo *rsi;
+        TupleDesc tupdesc;
+        struct pl_arg *args;
+        VALUE arg;
+
+        funcctx = SRF_FIRSTCALL_INIT();
+        PLRUBY_BEGIN_PROTECT(1);
+        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+        srf = (struct pl_srf *)palloc(sizeof(struct pl_srf));
+        tupdesc = pl_srf_desc(fcinfo, &srf->scalar);
+        MemoryContextSwitchTo(oldcontext);
+        PLRUBY_END_PROTECT;
+
+        arg = Data_Make_Struct(rb_cObject, struct pl_arg, pl_arg_mark, free, args);
+        args->pro = prodesc;
+        args->ary = ary;
+#if PG_PL_VERSION >= 75
+        args->named = prodesc->named_args;
+#endif
+        srf->tuple = Data_Make_Struct(rb_cData, struct pl_tuple, pl_thr_mark, 
+                                      free, tpl);
+        tpl->cxt = funcctx->multi_call_memory_ctx;
+        tpl->dsc = tupdesc;
+        PLRUBY_BEGIN_PROTECT(1);
+        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+        tpl->att = TupleDescGetAttInMetadata(tupdesc);
+        MemoryContextSwitchTo(oldcontext);
+        PLRUBY_END_PROTECT;
+        tpl->pro = prodesc;
+        tpl->emit = PL_EMIT_FIBER;
+        srf->fiber = rb_fiber_new(pl_srf_body, arg);
+        srf->batch = Qnil;
+        srf->pos = 0;
+        srf->key = INT2NUM(++pl_srf_count);
+        rb_hash_aset(pl_srf_states, srf->key, 
+                     rb_ary_new3(6, srf->fiber, srf->tuple, arg, Qnil, proc,
+                                 UINT2NUM(GetCurrentSubTransactionId())));
+        rsi = (ReturnSetInfo *)fcinfo->resultinfo;
+        PLRUBY_BEGIN_PROTECT(1);
+        RegisterExprContextCallback(rsi->econtext, pl_srf_shutdown,
+                                    Int32GetDatum(pl_srf_count));
+        PLRUBY_END_PROTECT;
+        funcctx->user_fctx = (void *)srf;
+    }
+    funcctx = SRF_PERCALL_SETUP();
+    srf = (struct pl_srf *)funcctx->user_fctx;
+    GetTuple(srf->tuple, tpl);
+    tpl->fcinfo = fcinfo;
+
+    while (1) {
+        if (!NIL_P(srf->batch) && srf->pos < RARRAY_LEN(srf->batch)) {
+            row = RARRAY_PTR(srf->batch)[srf->pos++];
+            break;
+        }
+        row = rb_protect(pl_srf_resume, (VALUE)srf, &state);
+        if (state) {
+            rb_hash_delete(pl_srf_states, srf->key);
+            rb_jump_tag(state);
+        }
+        if (row == pl_srf_done) {
+            rb_hash_delete(pl_srf_states, srf->key);
+            plruby_spi_finish();
+            SRF_RETURN_DONE(funcctx);
+        }
+        if (!PL_SRF_BATCH_P(row)) {
+            break;
+        }
+        srf->batch = RARRAY_PTR(row)[1];
+        srf->pos = 0;
+        rb_ary_store(rb_hash_aref(pl_srf_states, srf->key), 3, srf->batch);
+    }
+    tuple = pl_tuple_heap(row, srf->tuple);
+    if (srf->scalar) {
+        bool isnull;
+
+        result = heap_getattr(tuple, 1, tpl->dsc, &isnull);
+        fcinfo->isnull = isnull;
+    }
+    else {
+        result = HeapTupleGetDatum(tuple);
+    }
+    plruby_spi_finish();
+    SRF_RETURN_NEXT(funcctx, result);
+}
+
+#endif
+
+/*
+ * PL.emit_rows(rows) : the rows of a set returning function given by
+ * batch. In materialize mode a chunk of rows is converted in the same
+ * buffers, then formed and stored with one memory context switch
+ */
+#define PL_EMIT_VALUES 1024
+
+static VALUE
+pl_emit_rows(VALUE obj, VALUE rows)
+{
+    struct pl_tuple *tpl;
+    struct pl_out_meta *meta;
+    MemoryContext oldcxt;
+    TupleDesc tupdesc;
+    HeapTuple tmp;
+    Datum *dvalues;
+    PL_NULLS_T *nulls;
+    VALUE tuple;
+    long i, j, n, chunk;
+    int natts;
+
+    Check_Type(rows, T_ARRAY);
+    tuple = rb_thread_local_aref(rb_thread_current(), id_thr);
+    if (NIL_P(tuple)) {
+        rb_raise(pl_ePLruby, "emit_rows : not in a set returning function");
+    }
+    GetTuple(tuple, tpl);
+#ifdef PL_SRF_FIBER
+    if (tpl->emit == PL_EMIT_FIBER) {
+        if (RARRAY_LEN(rows)) {
+            pl_srf_yield(rb_assoc_new(pl_srf_batch, rows), Qnil);
+        }
+        return Qnil;
+    }
+#endif
+    if (tpl->emit != PL_EMIT_STORE) {
+        rb_raise(pl_ePLruby, "emit_rows : not in a set returning function");
+    }
+    meta = pl_tuple_out_meta(tpl);
+    tupdesc = tpl->att->tupdesc;
+    natts = tupdesc->natts?tupdesc->natts:1;
+    chunk = PL_EMIT_VALUES / natts;
+    if (chunk < 1) {
+        chunk = 1;
+    }
+    dvalues = ALLOCA_N(Datum, chunk * natts);
+    MEMZERO(dvalues, Datum, chunk * natts);
+    nulls = ALLOCA_N(PL_NULLS_T, chunk * natts);
+    for (i = 0; i < RARRAY_LEN(rows); i += n) {
+        n = RARRAY_LEN(rows) - i;
+        if (n > chunk) {
+            n = chunk;
+        }
+        for (j = 0; j < n; j++) {
+            pl_tuple_fill(rb_ary_entry(rows, i + j), tpl, meta,
+                          dvalues + j * natts, nulls + j * natts);
+        }
+        PLRUBY_BEGIN_PROTECT(1);
+        oldcxt = MemoryContextSwitchTo(tpl->cxt);
+        if (!tpl->out) {
+#if PG_PL_VERSION >= 74
+            tpl->out = tuplestore_begin_heap(true, false, SortMem);
+#else
+            tpl->out = tuplestore_begin_heap(true, SortMem);
+#endif
+        }
+        for (j = 0; j < n; j++) {
+            tmp = pl_form_tuple(tupdesc, dvalues + j * natts, nulls + j * natts);
+            tuplestore_puttuple(tpl->out, tmp);
+            heap_freetuple(tmp);
+        }
+        MemoryContextSwitchTo(oldcxt);
+        PLRUBY_END_PROTECT;
+    }
+    return Qnil;
+}
+
 Datum
-plruby_return_value(struct pl_thread_st *plth, pl_proc_desc *prodesc, 
-                    VALUE value_proname, VALUE ary)
+plruby_return_value(struct pl_thread_st *plth, VALUE proc,
+                    pl_proc_desc *prodesc, VALUE ary)
 {
     VALUE c;
     int expr_multiple;
@@ -1372,14 +3145,22 @@ plruby_return_value(struct pl_thread_st *plth, pl_proc_desc *prodesc,
         }
         rsi = (ReturnSetInfo *)fcinfo->resultinfo;
         if (prodesc->result_is_setof && !rsi->expectedDesc) {
+#ifdef PL_SRF_FIBER
+            return pl_srf_value_per_call(fcinfo, proc, prodesc, ary);
+#else
             VALUE  res, retary, arg;
             struct pl_arg *args;
             TupleDesc tupdesc;
             FuncCallContext *funcctx;
             Datum result;
 
+            if (rsi->allowedModes & SFRM_Materialize) {
+                pl_srf_materialize(fcinfo, prodesc, ary);
+                plruby_spi_finish();
+                PG_RETURN_NULL();
+            }
             arg = Data_Make_Struct(rb_cObject, struct pl_arg, pl_arg_mark, free, args);
-            args->id = rb_intern(RSTRING_PTR(value_proname));
+            args->pro = prodesc;
             args->ary = ary;
 #if PG_PL_VERSION >= 75
             args->named = prodesc->named_args;
@@ -1410,13 +3191,13 @@ plruby_return_value(struct pl_thread_st *plth, pl_proc_desc *prodesc,
                 retary = rb_ary_new();
 #if HAVE_RB_BLOCK_CALL
                 if (args->named) {
-                    res = rb_block_call(pl_mPLtemp, args->id,
+                    res = rb_block_call(prodesc->method, id_call,
                             RARRAY_LEN(args->ary),
                             RARRAY_PTR(args->ary),
                             pl_ary_collect, retary);
                 }
                 else {
-                    res = rb_block_call(pl_mPLtemp, args->id,
+                    res = rb_block_call(prodesc->method, id_call,
                             1, &args->ary,
                             pl_ary_collect, retary);
                 }
@@ -1459,18 +3240,7 @@ plruby_return_value(struct pl_thread_st *plth, pl_proc_desc *prodesc,
                 result = HeapTupleGetDatum(tuple);
             }
 
-            PLRUBY_BEGIN_PROTECT(1);
-            {
-                MemoryContext oldcxt;
-                int rc;
-
-                oldcxt = MemoryContextSwitchTo(plruby_spi_context);
-                if ((rc = SPI_finish()) != SPI_OK_FINISH) {
-                    elog(ERROR, "SPI_finish() failed : %d", rc);
-                }
-                MemoryContextSwitchTo(oldcxt);
-            }
-            PLRUBY_END_PROTECT;
+            plruby_spi_finish();
 
             if ( funcctx->call_cntr < funcctx->max_calls )
             {
@@ -1481,6 +3251,7 @@ plruby_return_value(struct pl_thread_st *plth, pl_proc_desc *prodesc,
                 SRF_RETURN_DONE(funcctx);
             }
 
+#endif
         } else if ((rsi->allowedModes & SFRM_Materialize) && rsi->expectedDesc) {
             VALUE tuple, res, arg;
             struct pl_arg *args;
@@ -1488,8 +3259,10 @@ plruby_return_value(struct pl_thread_st *plth, pl_proc_desc *prodesc,
             VALUE (*pl_call)(VALUE);
 
             tuple = pl_tuple_s_new(fcinfo, prodesc);
+            Data_Get_Struct(tuple, struct pl_tuple, tpl);
+            tpl->emit = PL_EMIT_STORE;
             arg = Data_Make_Struct(rb_cObject, struct pl_arg, pl_arg_mark, free, args);
-            args->id = rb_intern(RSTRING_PTR(value_proname));
+            args->pro = prodesc;
             args->ary = ary;
 #if PG_PL_VERSION >= 75
             args->named = prodesc->named_args;
@@ -1499,13 +3272,13 @@ plruby_return_value(struct pl_thread_st *plth, pl_proc_desc *prodesc,
 #if HAVE_RB_BLOCK_CALL
 		if (pl_call == pl_func) {
 		    if (args->named) {
-			res = rb_block_call(pl_mPLtemp, args->id, 
+			res = rb_block_call(prodesc->method, id_call, 
 					    RARRAY_LEN(args->ary),
 					    RARRAY_PTR(args->ary),
 					    pl_tuple_put, tuple);
 		    }
 		    else {
-			res = rb_block_call(pl_mPLtemp, args->id,
+			res = rb_block_call(prodesc->method, id_call,
 					    1, &args->ary,
 					    pl_tuple_put, tuple);
 		    }
@@ -1552,22 +3325,20 @@ plruby_return_value(struct pl_thread_st *plth, pl_proc_desc *prodesc,
                 args->ary = res;
                 pl_call = pl_string;
             }
+            tpl->emit = 0;
             c = Qnil;
         }
         else if (IsA(rsi, ReturnSetInfo)) {
             expr_multiple = 1;
 #if PG_PL_VERSION >= 75
             if (prodesc->named_args) {
-                c = rb_funcall2(pl_mPLtemp, rb_intern(RSTRING_PTR(value_proname)),
-                                RARRAY_LEN(ary), RARRAY_PTR(ary));
+                c = plruby_proc_call(prodesc, RARRAY_LEN(ary), RARRAY_PTR(ary));
             }
             else {
-                c = rb_funcall(pl_mPLtemp, rb_intern(RSTRING_PTR(value_proname)),
-                               1, ary);
+                c = plruby_proc_call(prodesc, 1, &ary);
             }
 #else
-            c = rb_funcall(pl_mPLtemp, rb_intern(RSTRING_PTR(value_proname)),
-                           1, ary);
+            c = plruby_proc_call(prodesc, 1, &ary);
 #endif
         }
         else {
@@ -1577,31 +3348,17 @@ plruby_return_value(struct pl_thread_st *plth, pl_proc_desc *prodesc,
     else {
 #if PG_PL_VERSION >= 75
         if (prodesc->named_args) {
-            c = rb_funcall2(pl_mPLtemp, rb_intern(RSTRING_PTR(value_proname)),
-                            RARRAY_LEN(ary), RARRAY_PTR(ary));
+            c = plruby_proc_call(prodesc, RARRAY_LEN(ary), RARRAY_PTR(ary));
         }
         else {
-            c = rb_funcall(pl_mPLtemp, rb_intern(RSTRING_PTR(value_proname)),
-                           1, ary);
+            c = plruby_proc_call(prodesc, 1, &ary);
         }
 #else
-        c = rb_funcall(pl_mPLtemp, rb_intern(RSTRING_PTR(value_proname)),
-                       1, ary);
+        c = plruby_proc_call(prodesc, 1, &ary);
 #endif
     }
 
-    PLRUBY_BEGIN_PROTECT(1);
-    {
-        MemoryContext oldcxt;
-        int rc;
-
-        oldcxt = MemoryContextSwitchTo(plruby_spi_context);
-        if ((rc = SPI_finish()) != SPI_OK_FINISH) {
-            elog(ERROR, "SPI_finish() failed : %d", rc);
-        }
-        MemoryContextSwitchTo(oldcxt);
-    }
-    PLRUBY_END_PROTECT;
+    plruby_spi_finish();
 
     if (c == Qnil) {
         if (expr_multiple) {
@@ -1635,8 +3392,12 @@ plruby_return_value(struct pl_thread_st *plth, pl_proc_desc *prodesc,
 #if PG_PL_VERSION >= 81
     if (prodesc->result_type == 'y') {
 	TupleDesc tupdesc;
+	TypeFuncClass tclass;
 	
-	if (get_call_result_type(fcinfo, NULL, &tupdesc) == TYPEFUNC_COMPOSITE) {
+	PLRUBY_BEGIN_PROTECT(1);
+	tclass = get_call_result_type(fcinfo, NULL, &tupdesc);
+	PLRUBY_END_PROTECT;
+	if (tclass == TYPEFUNC_COMPOSITE) {
 	    VALUE tmp;
 	    struct pl_tuple *tpl;
 
@@ -1644,8 +3405,18 @@ plruby_return_value(struct pl_thread_st *plth, pl_proc_desc *prodesc,
 				   free, tpl);
 	    GetTuple(tmp, tpl);
 	    tpl->pro = prodesc;
-	    tpl->dsc = tupdesc;
-	    tpl->att = TupleDescGetAttInMetadata(tupdesc);
+	    /* the conversions are kept with the descriptor in fn_extra */
+	    tpl->outm = pl_out_meta_cached(fcinfo, tupdesc);
+	    if (tpl->outm) {
+		tpl->dsc = tpl->outm->dsc;
+		tpl->att = tpl->outm->att;
+	    }
+	    else {
+		tpl->dsc = tupdesc;
+		PLRUBY_BEGIN_PROTECT(1);
+		tpl->att = TupleDescGetAttInMetadata(tupdesc);
+		PLRUBY_END_PROTECT;
+	    }
 	    return pl_tuple_datum(c, tmp);
 	}
     }
@@ -1654,6 +3425,8 @@ plruby_return_value(struct pl_thread_st *plth, pl_proc_desc *prodesc,
 }
 
 extern void Init_plruby_plan();
+extern void Init_plruby_vector();
+extern void Init_plruby_array();
 
 void Init_plruby_pl()
 {
@@ -1684,6 +3457,8 @@ void Init_plruby_pl()
     rb_define_module_function(pl_mPL, "args_type", pl_args_type, 0);
     rb_define_module_function(pl_mPL, "context", pl_context_get, 0);
     rb_define_module_function(pl_mPL, "context=", pl_context_set, 1);
+    rb_define_module_function(pl_mPL, "emit_rows", pl_emit_rows, 1);
+    rb_define_module_function(pl_mPL, "yield_batch", pl_emit_rows, 1);
     pl_ePLruby = rb_define_class_under(pl_mPL, "Error", rb_eStandardError);
     pl_eCatch = rb_define_class_under(pl_mPL, "Catch", rb_eStandardError);
     pl_mPLtemp = rb_define_module("PLtemp");
@@ -1696,6 +3471,20 @@ void Init_plruby_pl()
         rb_obj_taint(PLcontext);
     }
     id_thr = rb_intern("__functype__");
+    id_call = rb_intern("call");
+    id_plruby_tuple = rb_intern("plruby_tuple");
+    pl_tuples = rb_ary_new();
+    rb_global_variable(&pl_tuples);
+#ifdef PL_SRF_FIBER
+    RegisterXactCallback(pl_srf_xact, NULL);
+    RegisterSubXactCallback(pl_srf_subxact, NULL);
+    pl_srf_states = rb_hash_new();
+    rb_global_variable(&pl_srf_states);
+    pl_srf_done = rb_obj_alloc(rb_cObject);
+    rb_global_variable(&pl_srf_done);
+    pl_srf_batch = rb_obj_alloc(rb_cObject);
+    rb_global_variable(&pl_srf_batch);
+#endif
 #ifndef HAVE_RB_HASH_DELETE
     id_delete = rb_intern("delete");
 #endif
@@ -1704,5 +3493,7 @@ void Init_plruby_pl()
     id_to_datum = rb_intern("to_datum");
 #endif
     Init_plruby_plan();
+    Init_plruby_vector();
+    Init_plruby_array();
     pl_cPLPlan = rb_const_get(pl_mPL, rb_intern("Plan"));
 }
@@ -3,10 +3,275 @@
 static VALUE pl_cPLPlan, pl_cPLCursor, pl_ePLruby;
 static VALUE pl_eCatch;
 
+#ifndef HAVE_RB_HASH_DELETE
+static ID id_delete;
+
+#define rb_hash_delete(a, b) rb_funcall((a), id_delete, 1, (b))
+
+#endif
+
+/*
+ * LRU cache of saved plans, keyed by the query and the oids of the
+ * arguments. An entry is referenced by the PL::Plan given by prepare and
+ * by a running exec : an evicted entry still referenced is freed later
+ */
+
+#ifndef PLRUBY_PLAN_CACHE
+#define PLRUBY_PLAN_CACHE 128
+#endif
+
+struct pl_plan_entry {
+    VALUE key;
+    void *plan;
+    int refs;
+    struct pl_plan_entry *prev, *next;
+};
+
+static VALUE pl_plan_cache;
+static struct pl_plan_entry *pl_plan_head, *pl_plan_tail, *pl_plan_dead;
+static long pl_plan_max = PLRUBY_PLAN_CACHE;
+static long pl_plan_size, pl_plan_hits, pl_plan_misses, pl_plan_evictions;
+
+static void
+pl_plan_unlink(struct pl_plan_entry *entry)
+{
+    if (entry->prev) entry->prev->next = entry->next;
+    else pl_plan_head = entry->next;
+    if (entry->next) entry->next->prev = entry->prev;
+    else pl_plan_tail = entry->prev;
+    entry->prev = entry->next = NULL;
+}
+
+static void
+pl_plan_link(struct pl_plan_entry *entry)
+{
+    entry->prev = NULL;
+    entry->next = pl_plan_head;
+    if (pl_plan_head) pl_plan_head->prev = entry;
+    else pl_plan_tail = entry;
+    pl_plan_head = entry;
+}
+
+/* free the evicted plans which are no more used */
+static void
+pl_plan_sweep()
+{
+    struct pl_plan_entry *entry, **prev;
+
+    prev = &pl_plan_dead;
+    while ((entry = *prev) != NULL) {
+        if (entry->refs) {
+            prev = &entry->next;
+            continue;
+        }
+        *prev = entry->next;
+        PLRUBY_BEGIN_PROTECT(1);
+        SPI_freeplan(entry->plan);
+        PLRUBY_END_PROTECT;
+        free(entry);
+    }
+}
+
+static void
+pl_plan_evict(struct pl_plan_entry *entry)
+{
+    pl_plan_unlink(entry);
+    rb_hash_delete(pl_plan_cache, entry->key);
+    entry->key = Qnil;
+    entry->next = pl_plan_dead;
+    pl_plan_dead = entry;
+    pl_plan_size--;
+    pl_plan_evictions++;
+}
+
+#if PG_PL_VERSION >= 90
+
+struct pl_param_types {
+    Oid *types;
+    int ntypes;
+};
+
+static void
+pl_plan_parser_setup(struct ParseState *pstate, void *arg)
+{
+    struct pl_param_types *pt = (struct pl_param_types *)arg;
+
+    parse_variable_parameters(pstate, &pt->types, &pt->ntypes);
+}
+
+#endif
+
+/*
+ * give to the arguments without a type (InvalidOid) the type inferred by
+ * the parser from where they are used, as for a query sent by a client.
+ * A type which can't be inferred is unknown
+ */
+void
+plruby_plan_types(char *query, int nargs, Oid *argtypes)
+{
+#if PG_PL_VERSION >= 90
+    struct pl_param_types pt;
+    void *plan;
+    int i;
+
+    for (i = 0; i < nargs && OidIsValid(argtypes[i]); i++);
+    if (i == nargs) {
+        return;
+    }
+    PLRUBY_BEGIN_PROTECT(1);
+    pt.ntypes = nargs;
+    pt.types = (Oid *)palloc(nargs * sizeof(Oid));
+    memcpy(pt.types, argtypes, nargs * sizeof(Oid));
+    plan = SPI_prepare_params(query, pl_plan_parser_setup, &pt, 0);
+    if (plan == NULL) {
+        elog(ERROR, "SPI_prepare_params() failed - %d", SPI_result);
+    }
+    SPI_freeplan(plan);
+    for (i = 0; i < nargs; i++) {
+        if (i < pt.ntypes && OidIsValid(pt.types[i])) {
+            argtypes[i] = pt.types[i];
+        }
+        else {
+            argtypes[i] = UNKNOWNOID;
+        }
+    }
+    pfree(pt.types);
+    PLRUBY_END_PROTECT;
+#endif
+}
+
+static void *
+pl_plan_keep(char *query, int nargs, Oid *argtypes)
+{
+    void *plan;
+#if PG_PL_VERSION < 92
+    void *tmp;
+#endif
+
+    plruby_plan_types(query, nargs, argtypes);
+    PLRUBY_BEGIN_PROTECT(1);
+    plan = SPI_prepare(query, nargs, argtypes);
+    if (plan == NULL) {
+        elog(ERROR, "SPI_prepare() failed - %d", SPI_result);
+    }
+#if PG_PL_VERSION >= 92
+    SPI_keepplan(plan);
+#else
+    tmp = plan;
+    plan = SPI_saveplan(tmp);
+    SPI_freeplan(tmp);
+    if (plan == NULL) {
+        elog(ERROR, "SPI_saveplan() failed - %d", SPI_result);
+    }
+#endif
+    PLRUBY_END_PROTECT;
+    return plan;
+}
+
+/*
+ * the saved plan for the query, prepared on a miss. *entry must be given
+ * to plruby_plan_release when the plan is no more used. Return NULL when
+ * the cache is disabled
+ */
+void *
+plruby_plan_cached(char *query, int nargs, Oid *argtypes, void **handle)
+{
+    struct pl_plan_entry *entry;
+    VALUE key, value;
+
+    *handle = NULL;
+    if (pl_plan_max <= 0) {
+        return NULL;
+    }
+    pl_plan_sweep();
+    key = rb_str_new(query, strlen(query) + 1);
+    rb_str_cat(key, (char *)argtypes, nargs * sizeof(Oid));
+    value = rb_hash_aref(pl_plan_cache, key);
+    if (!NIL_P(value)) {
+        Data_Get_Struct(value, struct pl_plan_entry, entry);
+        pl_plan_hits++;
+        if (entry != pl_plan_head) {
+            pl_plan_unlink(entry);
+            pl_plan_link(entry);
+        }
+    }
+    else {
+        void *plan;
+
+        pl_plan_misses++;
+        plan = pl_plan_keep(query, nargs, argtypes);
+        entry = ALLOC(struct pl_plan_entry);
+        MEMZERO(entry, struct pl_plan_entry, 1);
+        entry->plan = plan;
+        entry->key = rb_obj_freeze(key);
+        rb_hash_aset(pl_plan_cache, key, Data_Wrap_Struct(rb_cObject, 0, 0, entry));
+        pl_plan_link(entry);
+        pl_plan_size++;
+        while (pl_plan_size > pl_plan_max) {
+            pl_plan_evict(pl_plan_tail);
+        }
+    }
+    entry->refs++;
+    *handle = entry;
+    return entry->plan;
+}
+
+void
+plruby_plan_release(void *handle)
+{
+    struct pl_plan_entry *entry = (struct pl_plan_entry *)handle;
+
+    if (entry && entry->refs > 0) {
+        entry->refs--;
+    }
+}
+
+static VALUE
+pl_plan_cache_size(VALUE obj)
+{
+    return LONG2NUM(pl_plan_max);
+}
+
+static VALUE
+pl_plan_cache_size_set(VALUE obj, VALUE a)
+{
+    pl_plan_max = NUM2LONG(a);
+    while (pl_plan_size > 0 && pl_plan_size > pl_plan_max) {
+        pl_plan_evict(pl_plan_tail);
+    }
+    pl_plan_sweep();
+    return a;
+}
+
+static VALUE
+pl_plan_cache_stats(VALUE obj)
+{
+    VALUE res;
+
+    res = rb_hash_new();
+    rb_hash_aset(res, rb_str_new2("size"), LONG2NUM(pl_plan_size));
+    rb_hash_aset(res, rb_str_new2("max"), LONG2NUM(pl_plan_max));
+    rb_hash_aset(res, rb_str_new2("hits"), LONG2NUM(pl_plan_hits));
+    rb_hash_aset(res, rb_str_new2("misses"), LONG2NUM(pl_plan_misses));
+    rb_hash_aset(res, rb_str_new2("evictions"), LONG2NUM(pl_plan_evictions));
+    return res;
+}
+
+static VALUE
+pl_plan_cache_clear(VALUE obj)
+{
+    while (pl_plan_tail) {
+        pl_plan_evict(pl_plan_tail);
+    }
+    pl_plan_sweep();
+    return Qnil;
+}
+
 static void
 query_free(qdesc)
     pl_query_desc *qdesc;
 {
+    plruby_plan_release(qdesc->cache);
     if (qdesc->argtypes) free(qdesc->argtypes);
     if (qdesc->arginfuncs) free(qdesc->arginfuncs);
     if (qdesc->argtypelems) free(qdesc->argtypelems);
@@ -14,6 +279,8 @@ query_free(qdesc)
     if (qdesc->arg_is_array) free(qdesc->arg_is_array);
     if (qdesc->arg_val) free(qdesc->arg_val);
     if (qdesc->arg_align) free(qdesc->arg_align);
+    if (qdesc->argvalues) free(qdesc->argvalues);
+    if (qdesc->argnulls) free(qdesc->argnulls);
     free(qdesc);
 }
 
@@ -39,6 +306,9 @@ pl_plan_save(VALUE obj)
     void *tmp;
 
     GetPlan(obj, qdesc);
+    if (qdesc->cache) {
+        return obj;
+    }
 
     PLRUBY_BEGIN_PROTECT(1);
     tmp = qdesc->plan;
@@ -125,6 +395,10 @@ pl_plan_init(int argc, VALUE *argv, VALUE obj)
         MEMZERO(qdesc->arg_val, bool, qdesc->nargs);
         qdesc->arg_align = ALLOC_N(char, qdesc->nargs);
         MEMZERO(qdesc->arg_align, char, qdesc->nargs);
+        qdesc->argvalues = ALLOC_N(Datum, qdesc->nargs);
+        MEMZERO(qdesc->argvalues, Datum, qdesc->nargs);
+        qdesc->argnulls = ALLOC_N(char, qdesc->nargs + 1);
+        MEMZERO(qdesc->argnulls, char, qdesc->nargs + 1);
         for (i = 0; i < qdesc->nargs; i++) {
             char *argcopy;
             List *names = NIL;
@@ -200,6 +474,13 @@ pl_plan_init(int argc, VALUE *argv, VALUE obj)
         }
     }
 
+    plruby_spi_connect();
+    if (qdesc->po.save &&
+        (plan = plruby_plan_cached(RSTRING_PTR(a), qdesc->nargs, 
+                                   qdesc->argtypes, &qdesc->cache))) {
+        qdesc->plan = plan;
+        return obj;
+    }
     {
 #ifdef PG_PL_TRYCATCH
         PG_TRY();
@@ -282,67 +563,70 @@ pl_plan_prepare(int argc, VALUE *argv, VALUE obj)
     return plruby_s_new(argc, argv, pl_cPLPlan);
 }
 
+/* convert the arguments of the plan into values and nulls */
+static void
+pl_plan_fill(pl_query_desc *qdesc, VALUE argsv, Datum *values, char *nulls)
+{
+    int j;
+
+    if (TYPE(argsv) != T_ARRAY) {
+        rb_raise(pl_ePLruby, "array expected for arguments");
+    }
+    if (RARRAY_LEN(argsv) != qdesc->nargs) {
+        rb_raise(pl_ePLruby, "length of arguments doesn't match # of arguments");
+    }
+    for (j = 0; j < qdesc->nargs; j++) {
+        if (NIL_P(RARRAY_PTR(argsv)[j])) {
+            nulls[j] = 'n';
+            values[j] = (Datum)NULL;
+        }
+        else {
+            if (qdesc->arg_is_array[j]) {
+                pl_proc_desc prodesc;
+
+                MEMZERO(&prodesc, pl_proc_desc, 1);
+                prodesc.result_func  = qdesc->arginfuncs[j];
+                prodesc.result_oid   = qdesc->argtypes[j];
+                prodesc.result_elem  = qdesc->argtypelems[j];
+                prodesc.result_len   = qdesc->arglen[j];
+                prodesc.result_val   = qdesc->arg_val[j];
+                prodesc.result_align = qdesc->arg_align[j];
+
+                nulls[j] = ' ';
+                values[j] = plruby_return_array(RARRAY_PTR(argsv)[j], &prodesc);
+            } 
+            else {
+                VALUE args = RARRAY_PTR(argsv)[j];
+                nulls[j] = ' ';
+                values[j] = plruby_to_datum(args, &qdesc->arginfuncs[j],
+                                            qdesc->argtypes[j], 
+                                            qdesc->argtypelems[j],
+                                            -1);
+            }
+
+        }
+    }
+    nulls[qdesc->nargs] = '\0';
+}
+
 static void
 process_args(pl_query_desc *qdesc, VALUE vortal)
 {
     struct PLportal *portal;
-    int callnargs, j;
-    VALUE argsv;
+    int callnargs;
 
     Data_Get_Struct(vortal, struct PLportal, portal);
     if (qdesc->nargs > 0) {
-        argsv = portal->po.argsv;
-        if (TYPE(argsv) != T_ARRAY) {
-            rb_raise(pl_ePLruby, "array expected for arguments");
-        }
-        if (RARRAY_LEN(argsv) != qdesc->nargs) {
-            rb_raise(pl_ePLruby, "length of arguments doesn't match # of arguments");
-        }
-        callnargs = RARRAY_LEN(argsv);
+        callnargs = qdesc->nargs;
         portal->nargs = callnargs;
         portal->nulls = ALLOC_N(char, callnargs + 1);
         MEMZERO(portal->nulls, char, callnargs + 1);
         portal->argvalues = ALLOC_N(Datum, callnargs);
         MEMZERO(portal->argvalues, Datum, callnargs);
         portal->arglen = ALLOC_N(int, callnargs);
-        MEMZERO(portal->arglen, int, callnargs);
-        for (j = 0; j < callnargs; j++) {
-            if (NIL_P(RARRAY_PTR(argsv)[j])) {
-                portal->nulls[j] = 'n';
-                portal->argvalues[j] = (Datum)NULL;
-            }
-            else {
-                if (qdesc->arg_is_array[j]) {
-                    pl_proc_desc prodesc;
-
-                    MEMZERO(&prodesc, pl_proc_desc, 1);
-                    prodesc.result_func  = qdesc->arginfuncs[j];
-                    prodesc.result_oid   = qdesc->argtypes[j];
-                    prodesc.result_elem  = qdesc->argtypelems[j];
-                    prodesc.result_len   = qdesc->arglen[j];
-                    prodesc.result_val   = qdesc->arg_val[j];
-                    prodesc.result_align = qdesc->arg_align[j];
-
-                    portal->nulls[j] = ' ';
-                    portal->arglen[j] = qdesc->arglen[j];
-
-                    portal->argvalues[j] =
-                        plruby_return_array(RARRAY_PTR(argsv)[j], &prodesc);
-                } 
-                else {
-                    VALUE args = RARRAY_PTR(argsv)[j];
-                    portal->nulls[j] = ' ';
-                    portal->arglen[j] = qdesc->arglen[j];
-                    portal->argvalues[j] =
-                        plruby_to_datum(args, &qdesc->arginfuncs[j],
-                                        qdesc->argtypes[j], 
-                                        qdesc->argtypelems[j],
-                                        -1);
-                }
-
-            }
-        }
-        portal->nulls[callnargs] = '\0';
+        MEMCPY(portal->arglen, qdesc->arglen, int, callnargs);
+        pl_plan_fill(qdesc, portal->po.argsv, portal->argvalues, 
+                     portal->nulls);
     }
     return;
 }
@@ -416,8 +700,9 @@ plruby_i_each(VALUE obj, struct portal_options *po)
     return Qnil;
 }
 
+/* the portal with the options of the plan and of the call */
 static VALUE
-create_vortal(int argc, VALUE *argv, VALUE obj)
+vortal_options(int argc, VALUE *argv, VALUE obj)
 {
     VALUE vortal, argsv, countv, c;
     struct PLportal *portal;
@@ -448,11 +733,215 @@ create_vortal(int argc, VALUE *argv, VALUE obj)
     case 1:
         portal->po.argsv = argsv;
     }
+    return vortal;
+}
+
+static VALUE
+create_vortal(int argc, VALUE *argv, VALUE obj)
+{
+    VALUE vortal;
+    struct PLportal *portal;
+    pl_query_desc *qdesc;
+
+    GetPlan(obj, qdesc);
+    vortal = vortal_options(argc, argv, obj);
+    Data_Get_Struct(vortal, struct PLportal, portal);
     process_args(qdesc, vortal);
     portal->po.argsv = 0;
     return vortal;
 }
 
+/*
+ * execp with positional arguments, each and cursor : the values are
+ * converted in the buffers of the plan, unless the plan is already
+ * running them. A portal keeps its own copy of the values
+ */
+struct pl_plan_call {
+    pl_query_desc *qdesc;
+    Datum *values;
+    char *nulls, *name;
+    int count, rc, done, cursor;
+    Portal portal;
+};
+
+static VALUE
+pl_plan_call(VALUE arg)
+{
+    struct pl_plan_call *call = (struct pl_plan_call *)arg;
+    pl_query_desc *qdesc = call->qdesc;
+
+    PLRUBY_BEGIN_PROTECT(1);
+    if (call->cursor) {
+#if PG_PL_VERSION >= 80
+        call->portal = SPI_cursor_open(call->name, qdesc->plan, call->values,
+                                       call->nulls, false);
+#else
+        call->portal = SPI_cursor_open(call->name, qdesc->plan,
+                                       call->values, call->nulls);
+#endif
+    }
+    else {
+        call->rc = SPI_execp(qdesc->plan, call->values, call->nulls,
+                             call->count);
+    }
+    PLRUBY_END_PROTECT;
+    call->done = 1;
+    return Qnil;
+}
+
+static VALUE
+pl_plan_unfill(VALUE arg)
+{
+    struct pl_plan_call *call = (struct pl_plan_call *)arg;
+    pl_query_desc *qdesc = call->qdesc;
+    int j;
+
+    if (call->done) {
+        PLRUBY_BEGIN_PROTECT(1);
+        for (j = 0; j < qdesc->nargs; j++) {
+            if (qdesc->arglen[j] < 0 && qdesc->argvalues[j] != (Datum)NULL) {
+                pfree((char *)qdesc->argvalues[j]);
+            }
+            qdesc->argvalues[j] = (Datum)NULL;
+        }
+        PLRUBY_END_PROTECT;
+    }
+    qdesc->argbusy = 0;
+    return Qnil;
+}
+
+/*
+ * exec_batch(rows) : execute the plan once for each Array of arguments,
+ * with the same buffers, and return the number of rows processed. An
+ * error gives the index of the row
+ */
+struct pl_plan_batch {
+    pl_query_desc *qdesc;
+    VALUE rows;
+    Datum *values;
+    char *nulls;
+    long row, total;
+    int own;
+#if PG_PL_VERSION >= 74
+    ErrorContextCallback errcb;
+#endif
+};
+
+#if PG_PL_VERSION >= 74
+static void
+pl_plan_batch_context(void *arg)
+{
+    struct pl_plan_batch *batch = (struct pl_plan_batch *)arg;
+
+    errcontext("exec_batch row %ld", batch->row);
+}
+#endif
+
+static VALUE
+pl_plan_batch_loop(VALUE arg)
+{
+    struct pl_plan_batch *batch = (struct pl_plan_batch *)arg;
+    pl_query_desc *qdesc = batch->qdesc;
+    int j, spi_rc;
+
+    for (batch->row = 0; batch->row < RARRAY_LEN(batch->rows); batch->row++) {
+        if (qdesc->nargs > 0) {
+            pl_plan_fill(qdesc, rb_ary_entry(batch->rows, batch->row),
+                         batch->values, batch->nulls);
+        }
+        PLRUBY_BEGIN_PROTECT(1);
+        spi_rc = SPI_execp(qdesc->plan, batch->values, batch->nulls, 0);
+        if (spi_rc >= 0) {
+            batch->total += SPI_processed;
+            SPI_freetuptable(SPI_tuptable);
+        }
+        for (j = 0; j < qdesc->nargs; j++) {
+            if (qdesc->arglen[j] < 0 && batch->values[j] != (Datum)NULL) {
+                pfree((char *)batch->values[j]);
+            }
+            batch->values[j] = (Datum)NULL;
+        }
+        PLRUBY_END_PROTECT;
+        if (spi_rc < 0) {
+            rb_raise(pl_ePLruby, "SPI_execp() failed - %d", spi_rc);
+        }
+    }
+    return Qnil;
+}
+
+static VALUE
+pl_plan_batch_rescue(VALUE arg, VALUE exc)
+{
+    struct pl_plan_batch *batch = (struct pl_plan_batch *)arg;
+    char buf[64];
+    VALUE mesg;
+
+    if (rb_obj_is_kind_of(exc, pl_eCatch)) {
+        rb_exc_raise(exc);
+    }
+    sprintf(buf, "exec_batch : row %ld : ", batch->row);
+    mesg = rb_str_new2(buf);
+    rb_str_concat(mesg, rb_obj_as_string(exc));
+    rb_exc_raise(rb_exc_new3(rb_obj_class(exc), mesg));
+    return Qnil;
+}
+
+static VALUE
+pl_plan_batch_body(VALUE arg)
+{
+    return rb_rescue2(pl_plan_batch_loop, arg, pl_plan_batch_rescue, arg,
+                      rb_eStandardError, (VALUE)0);
+}
+
+static VALUE
+pl_plan_batch_end(VALUE arg)
+{
+    struct pl_plan_batch *batch = (struct pl_plan_batch *)arg;
+
+#if PG_PL_VERSION >= 74
+    error_context_stack = batch->errcb.previous;
+#endif
+    if (batch->own) {
+        batch->qdesc->argbusy = 0;
+    }
+    return Qnil;
+}
+
+static VALUE
+pl_plan_exec_batch(VALUE obj, VALUE rows)
+{
+    struct pl_plan_batch batch;
+    pl_query_desc *qdesc;
+
+    GetPlan(obj, qdesc);
+    Check_Type(rows, T_ARRAY);
+    MEMZERO(&batch, struct pl_plan_batch, 1);
+    batch.qdesc = qdesc;
+    batch.rows = rows;
+    if (qdesc->nargs > 0) {
+        if (qdesc->argbusy) {
+            batch.values = ALLOCA_N(Datum, qdesc->nargs);
+            MEMZERO(batch.values, Datum, qdesc->nargs);
+            batch.nulls = ALLOCA_N(char, qdesc->nargs + 1);
+        }
+        else {
+            batch.values = qdesc->argvalues;
+            batch.nulls = qdesc->argnulls;
+            batch.own = qdesc->argbusy = 1;
+        }
+    }
+    plruby_spi_connect();
+#if PG_PL_VERSION >= 74
+    batch.errcb.callback = pl_plan_batch_context;
+    batch.errcb.arg = (void *)&batch;
+    batch.errcb.previous = error_context_stack;
+    error_context_stack = &batch.errcb;
+#endif
+    rb_ensure(pl_plan_batch_body, (VALUE)&batch, 
+              pl_plan_batch_end, (VALUE)&batch);
+    return LONG2NUM(batch.total);
+}
+
 static VALUE
 pl_plan_execp(argc, argv, obj)
     int argc;
@@ -462,6 +951,7 @@ pl_plan_execp(argc, argv, obj)
     int i, spi_rc, count, typout;
     VALUE result;
     VALUE vortal;
+    volatile VALUE meta;
     pl_query_desc *qdesc;
     int ntuples;
     HeapTuple *tuples = NULL;
@@ -469,16 +959,47 @@ pl_plan_execp(argc, argv, obj)
     struct PLportal *portal;
 
     GetPlan(obj, qdesc);
-    vortal = create_vortal(argc, argv, obj);
-    Data_Get_Struct(vortal, struct PLportal, portal);
-    PLRUBY_BEGIN_PROTECT(1);
-    spi_rc = SPI_execp(qdesc->plan, portal->argvalues,
-                       portal->nulls, portal->po.count);
-    Data_Get_Struct(vortal, struct PLportal, portal);
-    free_args(portal);
-    PLRUBY_END_PROTECT;
-    count = portal->po.count;
-    typout = portal->po.output;
+    if (!qdesc->argbusy && !(argc && TYPE(argv[argc - 1]) == T_HASH)) {
+        struct pl_plan_call call;
+        VALUE argsv, countv, c;
+
+        count = qdesc->po.count;
+        typout = qdesc->po.output?qdesc->po.output:RET_HASH;
+        switch (rb_scan_args(argc, argv, "03", &argsv, &countv, &c)) {
+        case 3:
+            plruby_exec_output(c, RET_ARRAY, &typout);
+            /* ... */
+        case 2:
+            if (!NIL_P(countv)) {
+                count = NUM2INT(countv);
+            }
+        }
+        if (qdesc->nargs > 0) {
+            pl_plan_fill(qdesc, argsv, qdesc->argvalues, qdesc->argnulls);
+        }
+        MEMZERO(&call, struct pl_plan_call, 1);
+        call.qdesc = qdesc;
+        call.values = qdesc->argvalues;
+        call.nulls = qdesc->argnulls;
+        call.count = count;
+        qdesc->argbusy = 1;
+        plruby_spi_connect();
+        rb_ensure(pl_plan_call, (VALUE)&call, pl_plan_unfill, (VALUE)&call);
+        spi_rc = call.rc;
+    }
+    else {
+        vortal = create_vortal(argc, argv, obj);
+        Data_Get_Struct(vortal, struct PLportal, portal);
+        plruby_spi_connect();
+        PLRUBY_BEGIN_PROTECT(1);
+        spi_rc = SPI_execp(qdesc->plan, portal->argvalues,
+                           portal->nulls, portal->po.count);
+        Data_Get_Struct(vortal, struct PLportal, portal);
+        free_args(portal);
+        PLRUBY_END_PROTECT;
+        count = portal->po.count;
+        typout = portal->po.output;
+    }
 
     switch (spi_rc) {
     case SPI_OK_UTILITY:
@@ -518,6 +1039,15 @@ pl_plan_execp(argc, argv, obj)
         rb_raise(pl_ePLruby, "SPI_exec() failed - unknown RC %d", spi_rc);
     }
     
+    if (typout & RET_COLUMNS) {
+        result = plruby_build_columns(SPI_tuptable, SPI_processed, typout);
+        SPI_freetuptable(SPI_tuptable);
+        if (rb_block_given_p()) {
+            rb_yield(result);
+            return Qtrue;
+        }
+        return result;
+    }
     ntuples = SPI_processed;
     if (ntuples <= 0) {
         SPI_freetuptable(SPI_tuptable);
@@ -539,8 +1069,9 @@ pl_plan_execp(argc, argv, obj)
             plruby_build_tuple(tuples[0], tupdesc, form);
         }
         else {
+            meta = plruby_tuple_meta(tupdesc);
             for (i = 0; i < ntuples; i++) {
-                rb_yield(plruby_build_tuple(tuples[i], tupdesc, typout));
+                rb_yield(plruby_build_tuple_meta(tuples[i], meta, typout));
             }
         }
         result = Qtrue;
@@ -550,10 +1081,11 @@ pl_plan_execp(argc, argv, obj)
             result = plruby_build_tuple(tuples[0], tupdesc, typout);
         }
         else {
+            meta = plruby_tuple_meta(tupdesc);
             result = rb_ary_new2(ntuples);
             for (i = 0; i < ntuples; i++) {
                 rb_ary_push(result, 
-                            plruby_build_tuple(tuples[i], tupdesc, typout));
+                            plruby_build_tuple_meta(tuples[i], meta, typout));
             }
         }
     }
@@ -561,16 +1093,6 @@ pl_plan_execp(argc, argv, obj)
     return result;
 }
 
-#if PG_PL_VERSION == 74
-#define PORTAL_ACTIVE(port) ((port)->portalActive)
-#elif WITH_GREENPLUM == 1
-#define  PORTAL_ACTIVE(port) ((port)->portal_status == PORTAL_ACTIVE)
-#elif PG_PL_VERSION > 74
-#define  PORTAL_ACTIVE(port) ((port)->status == PORTAL_ACTIVE)
-#else
-#define PORTAL_ACTIVE(port) 0
-#endif
-
 static VALUE
 pl_close(VALUE vortal)
 {
@@ -603,6 +1125,7 @@ pl_fetch(VALUE vortal)
     TupleDesc tupdesc = NULL;
     SPITupleTable *tuptab;
     int i, proces, pcount, block, count;
+    volatile VALUE meta, rows;
 
     GetPortal(vortal, portal);
     count = 0;
@@ -610,6 +1133,7 @@ pl_fetch(VALUE vortal)
     if (portal->po.count) pcount = portal->po.count;
     else pcount = -1;
     while (count != pcount) {
+        plruby_spi_connect();
         PLRUBY_BEGIN_PROTECT(1);
         SPI_cursor_fetch(portal->portal, true, block);
         PLRUBY_END_PROTECT;
@@ -620,47 +1144,88 @@ pl_fetch(VALUE vortal)
         tuptab = SPI_tuptable;
         tuples = tuptab->vals;
         tupdesc = tuptab->tupdesc;
-        for (i = 0; i < proces && count != pcount; ++i, ++count) {
-            rb_yield(plruby_build_tuple(tuples[i], tupdesc, portal->po.output));
+        if (pcount > 0 && proces > pcount - count) {
+            proces = pcount - count;
+        }
+        if (portal->po.output & RET_COLUMNS) {
+            rows = plruby_build_columns(tuptab, proces, portal->po.output);
+            SPI_freetuptable(tuptab);
+            rb_yield(rows);
+            count += proces;
+            continue;
+        }
+        meta = plruby_tuple_meta(tupdesc);
+        rows = rb_ary_new2(proces);
+        for (i = 0; i < proces; ++i) {
+            rb_ary_push(rows, plruby_build_tuple_meta(tuples[i], meta, 
+                                                      portal->po.output));
         }
         SPI_freetuptable(tuptab);
+        /* the block can leave SPI, e.g. to give a row of a SETOF function */
+        for (i = 0; i < proces; ++i, ++count) {
+            rb_yield(RARRAY_PTR(rows)[i]);
+        }
     }
     return Qnil;
 }
 
 
+static VALUE
+pl_plan_open(int argc, VALUE *argv, VALUE obj, char *name)
+{
+    pl_query_desc *qdesc;
+    struct PLportal *portal;
+    struct pl_plan_call call;
+    VALUE vortal;
+
+    GetPlan(obj, qdesc);
+    vortal = vortal_options(argc, argv, obj);
+    Data_Get_Struct(vortal, struct PLportal, portal);
+    MEMZERO(&call, struct pl_plan_call, 1);
+    call.qdesc = qdesc;
+    call.name = name;
+    call.cursor = 1;
+    if (qdesc->argbusy) {
+        process_args(qdesc, vortal);
+        call.values = portal->argvalues;
+        call.nulls = portal->nulls;
+        plruby_spi_connect();
+        pl_plan_call((VALUE)&call);
+        PLRUBY_BEGIN_PROTECT(1);
+        free_args(portal);
+        PLRUBY_END_PROTECT;
+    }
+    else {
+        if (qdesc->nargs > 0) {
+            pl_plan_fill(qdesc, portal->po.argsv, qdesc->argvalues,
+                         qdesc->argnulls);
+        }
+        call.values = qdesc->argvalues;
+        call.nulls = qdesc->argnulls;
+        qdesc->argbusy = 1;
+        plruby_spi_connect();
+        rb_ensure(pl_plan_call, (VALUE)&call, pl_plan_unfill, (VALUE)&call);
+    }
+    portal->po.argsv = 0;
+    if (call.portal == NULL) {
+        rb_raise(pl_ePLruby,  "SPI_cursor_open() failed");
+    }
+    portal->portal = call.portal;
+    return vortal;
+}
+
 static VALUE
 pl_plan_each(argc, argv, obj)
     int argc;
     VALUE *argv;
     VALUE obj;
 {
-    pl_query_desc *qdesc;
-    Portal pgportal;
-    struct PLportal *portal;
     VALUE vortal;
 
     if (!rb_block_given_p()) {
         rb_raise(pl_ePLruby, "a block must be given");
     }
-    GetPlan(obj, qdesc);
-    vortal = create_vortal(argc, argv, obj);
-    Data_Get_Struct(vortal, struct PLportal, portal);
-    PLRUBY_BEGIN_PROTECT(1);
-#if PG_PL_VERSION >= 80
-    pgportal = SPI_cursor_open(NULL, qdesc->plan, portal->argvalues,
-			       portal->nulls, false);
-#else
-    pgportal = SPI_cursor_open(NULL, qdesc->plan, 
-                               portal->argvalues, portal->nulls);
-#endif
-    Data_Get_Struct(vortal, struct PLportal, portal);
-    free_args(portal);
-    PLRUBY_END_PROTECT;
-    if (pgportal == NULL) {
-        rb_raise(pl_ePLruby,  "SPI_cursor_open() failed");
-    }
-    portal->portal = pgportal;
+    vortal = pl_plan_open(argc, argv, obj, NULL);
     rb_ensure(pl_fetch, vortal, pl_close, vortal);
     return Qnil;
 }
@@ -669,12 +1234,7 @@ static VALUE
 pl_plan_cursor(int argc, VALUE *argv, VALUE obj)
 {
     char *name = NULL;
-    pl_query_desc *qdesc;
-    Portal pgportal;
-    struct PLportal *portal;
-    VALUE vortal;
 
-    GetPlan(obj, qdesc);
     if (argc && TYPE(argv[0]) != T_HASH) {
         if (!NIL_P(argv[0])) {
             if (TYPE(argv[0]) != T_STRING) {
@@ -684,22 +1244,7 @@ pl_plan_cursor(int argc, VALUE *argv, VALUE obj)
         }
         --argc; ++argv;
     }
-    vortal = create_vortal(argc, argv, obj);
-    Data_Get_Struct(vortal, struct PLportal, portal);
-    PLRUBY_BEGIN_PROTECT(1);
-#if PG_PL_VERSION >= 80
-    pgportal = SPI_cursor_open(name, qdesc->plan, portal->argvalues,
-			       portal->nulls, false);
-#else
-    pgportal = SPI_cursor_open(name, qdesc->plan, 
-                               portal->argvalues, portal->nulls);
-#endif
-    PLRUBY_END_PROTECT;
-    if (pgportal == NULL) {
-        rb_raise(pl_ePLruby,  "SPI_cursor_open() failed");
-    }
-    portal->portal = pgportal;
-    return vortal;
+    return pl_plan_open(argc, argv, obj, name);
 }
 
 static VALUE
@@ -709,6 +1254,12 @@ pl_plan_release(VALUE obj)
     int spi_rc;
 
     GetPlan(obj, qdesc);
+    if (qdesc->cache) {
+        plruby_plan_release(qdesc->cache);
+        qdesc->cache = NULL;
+        qdesc->plan = 0;
+        return Qnil;
+    }
     PLRUBY_BEGIN_PROTECT(1);
     spi_rc = SPI_freeplan(qdesc->plan);
     qdesc->plan = 0;
@@ -735,6 +1286,7 @@ pl_cursor_move(VALUE obj, VALUE a)
         else {
             forward = 1;
         }
+        plruby_spi_connect();
         PLRUBY_BEGIN_PROTECT(1);
         SPI_cursor_move(portal->portal, forward, count);
         PLRUBY_END_PROTECT;
@@ -749,6 +1301,7 @@ pl_cursor_fetch(int argc, VALUE *argv, VALUE obj)
     SPITupleTable *tup;
     int proces, forward, count, i;
     VALUE a, res;
+    volatile VALUE meta;
 
     GetPortal(obj, portal);
     forward = count = 1;
@@ -764,6 +1317,7 @@ pl_cursor_fetch(int argc, VALUE *argv, VALUE obj)
     if (!count) {
         return Qnil;
     }
+    plruby_spi_connect();
     PLRUBY_BEGIN_PROTECT(1);
     SPI_cursor_fetch(portal->portal, forward, count);
     PLRUBY_END_PROTECT;
@@ -772,14 +1326,18 @@ pl_cursor_fetch(int argc, VALUE *argv, VALUE obj)
     if (proces <= 0) {
         return Qnil;
     }
-    if (proces == 1) {
+    if (portal->po.output & RET_COLUMNS) {
+        res = plruby_build_columns(tup, proces, portal->po.output);
+    }
+    else if (proces == 1) {
         res = plruby_build_tuple(tup->vals[0], tup->tupdesc, portal->po.output);
     }
     else {
+        meta = plruby_tuple_meta(tup->tupdesc);
         res = rb_ary_new2(proces);
         for (i = 0; i < proces; ++i) {
-            rb_ary_push(res, plruby_build_tuple(tup->vals[i], tup->tupdesc, 
-                                             portal->po.output));
+            rb_ary_push(res, plruby_build_tuple_meta(tup->vals[i], meta, 
+                                                     portal->po.output));
         }
     }
     SPI_freetuptable(tup);
@@ -840,6 +1398,7 @@ pl_cursor_rewind(VALUE obj)
 
     GetPortal(obj, portal);
     while (proces) {
+        plruby_spi_connect();
         PLRUBY_BEGIN_PROTECT(1);
         SPI_cursor_move(portal->portal, 0, 12);
         PLRUBY_END_PROTECT;
@@ -858,6 +1417,15 @@ void Init_plruby_plan()
     /* deprecated */
     rb_define_module_function(pl_mPL, "spi_prepare", pl_plan_prepare, -1);
     rb_define_module_function(pl_mPL, "prepare", pl_plan_prepare, -1);
+    rb_define_module_function(pl_mPL, "plan_cache_size", pl_plan_cache_size, 0);
+    rb_define_module_function(pl_mPL, "plan_cache_size=", pl_plan_cache_size_set, 1);
+    rb_define_module_function(pl_mPL, "plan_cache_stats", pl_plan_cache_stats, 0);
+    rb_define_module_function(pl_mPL, "plan_cache_clear", pl_plan_cache_clear, 0);
+    pl_plan_cache = rb_hash_new();
+    rb_global_variable(&pl_plan_cache);
+#ifndef HAVE_RB_HASH_DELETE
+    id_delete = rb_intern("delete");
+#endif
     /* ... */
     pl_cPLPlan = rb_define_class_under(pl_mPL, "Plan", rb_cObject);
     rb_include_module(pl_cPLPlan, rb_mEnumerable);
@@ -873,6 +1441,7 @@ void Init_plruby_plan()
     rb_define_method(pl_cPLPlan, "spi_execp", pl_plan_execp, -1);
     rb_define_method(pl_cPLPlan, "execp", pl_plan_execp, -1);
     rb_define_method(pl_cPLPlan, "exec", pl_plan_execp, -1);
+    rb_define_method(pl_cPLPlan, "exec_batch", pl_plan_exec_batch, 1);
     rb_define_method(pl_cPLPlan, "spi_fetch", pl_plan_each, -1);
     rb_define_method(pl_cPLPlan, "each", pl_plan_each, -1);
     rb_define_method(pl_cPLPlan, "fetch", pl_plan_each, -1);
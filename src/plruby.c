@@ -46,6 +46,12 @@
 
 #include "plruby.h"
 
+#ifdef PLRUBY_ISEQ_CACHE
+#include <sys/stat.h>
+#include <dirent.h>
+#include "miscadmin.h"
+#endif
+
 PG_FUNCTION_INFO_V1(PLRUBY_CALL_HANDLER);
 
 static Datum pl_func_handler(struct pl_thread_st *);
@@ -59,17 +65,29 @@ static Datum pl_validator_handler(struct pl_thread_st *);
 PG_MODULE_MAGIC;
 #endif
 
+#if PG_PL_VERSION >= 84
+void _PG_init(void);
+#endif
+
 #ifdef PLRUBY_TIMEOUT
 int plruby_in_progress = 0;
 int plruby_interrupted = 0;
 #endif
 
 static ID id_to_s, id_raise, id_kill, id_alive, id_value, id_call, id_thr;
+#ifdef RUBY_CAN_BIND_ANY
+static ID id_module_eval, id_instance_method, id_bind;
+#endif
+#ifdef PLRUBY_ISEQ_CACHE
+static ID id_compile, id_to_binary, id_load_from_binary, id_extra_data, id_eval;
+static VALUE pl_cISeq, pl_iseq_oids;
+static int pl_iseq_stale = 0, pl_iseq_checked = 0;
+#endif
 
 static int      pl_firstcall = 1;
 static int      pl_call_level = 0;
 static VALUE    pl_ePLruby, pl_eCatch;
-static VALUE    pl_mPLtemp, pl_sPLtemp;
+static VALUE    pl_mPLtemp;
 static VALUE    PLruby_hash;
 
 VALUE
@@ -80,6 +98,14 @@ plruby_s_new(int argc, VALUE *argv, VALUE obj)
     return res;
 }
 
+static void
+pl_proc_mark(proc)
+    pl_proc_desc *proc;
+{
+    rb_gc_mark(proc->method);
+    rb_gc_mark(proc->args);
+}
+
 static void
 pl_proc_free(proc)
     pl_proc_desc *proc;
@@ -98,6 +124,28 @@ pl_proc_free(proc)
     Data_Get_Struct(value_, pl_proc_desc, procdesc_);           \
 } while (0)
 
+#if PG_PL_VERSION >= 75
+
+static unsigned long pl_proc_generation = 1;
+
+#if PG_PL_VERSION >= 92
+static void
+pl_proc_inval(Datum arg, int cacheid, uint32 hashvalue)
+#else
+static void
+pl_proc_inval(Datum arg, int cacheid, ItemPointer tuplePtr)
+#endif
+{
+    pl_proc_generation++;
+#ifdef PLRUBY_ISEQ_CACHE
+    if (cacheid == PROCOID) {
+        pl_iseq_stale = 1;
+    }
+#endif
+}
+
+#endif
+
 VALUE
 plruby_to_s(VALUE obj)
 {
@@ -318,10 +366,70 @@ plruby_dfc3(PGFunction func, Datum arg1, Datum arg2, Datum arg3)
     return result;
 }
 
+#if PLRUBY_ENABLE_CONVERSION
+
+/*
+ * Each conversion module gives the types it converts, and either the
+ * class that it defines or the ruby class that it extends. Nothing is
+ * loaded until a type of the module is met.
+ */
+struct pl_conversion {
+    Oid oid;
+    char *library;
+    char *name;
+    VALUE *klass;
+    int loaded;
+};
+
+static struct pl_conversion pl_conversions[] = {
+#include "conversions.h"
+    { InvalidOid, NULL, NULL, NULL, 0 }
+};
+
+static void
+pl_conversion_load(struct pl_conversion *conv)
+{
+    struct pl_conversion *c;
+
+    if (conv->loaded) {
+        return;
+    }
+    plruby_require(conv->library);
+    for (c = pl_conversions; c->library; ++c) {
+        if (strcmp(c->library, conv->library) == 0) {
+            c->loaded = 1;
+        }
+    }
+}
+
+/* the class converting typoid, or Qfalse */
+VALUE
+plruby_conversion_class(Oid typoid)
+{
+    struct pl_conversion *conv;
+
+    for (conv = pl_conversions; conv->library; ++conv) {
+        if (conv->oid != typoid) {
+            continue;
+        }
+        if (conv->name) {
+            /* autoload or the void class require the library */
+            return rb_const_get(rb_cObject, rb_intern(conv->name));
+        }
+        pl_conversion_load(conv);
+        return *conv->klass;
+    }
+    return Qfalse;
+}
+
+#endif
+
 static void
 pl_init_conversions()
 {
 #if PLRUBY_ENABLE_CONVERSION
+    struct pl_conversion *conv;
+
 #ifndef RUBY_CAN_USE_AUTOLOAD
     pl_require_thread = rb_thread_create(pl_require_th, 0);
 #endif
@@ -329,18 +437,42 @@ pl_init_conversions()
     rb_global_variable(&plruby_classes);
     plruby_conversions = rb_hash_new();
     rb_global_variable(&plruby_conversions);
-#include "conversions.h"
+    for (conv = pl_conversions; conv->library; ++conv) {
+#if PG_PL_VERSION >= 84
+        /* preloaded : the backends inherit the loaded libraries */
+        if (process_shared_preload_libraries_in_progress) {
+            pl_conversion_load(conv);
+            continue;
+        }
+#endif
+        if (!conv->name) {
+#ifndef RUBY_CAN_USE_LAZY_REQUIRE
+            /* the library can't be loaded later, with the safe level */
+            pl_conversion_load(conv);
+#endif
+            continue;
+        }
+        if (rb_const_defined_at(rb_cObject, rb_intern(conv->name))) {
+            continue;
+        }
+#if RUBY_CAN_USE_AUTOLOAD
+        rb_funcall(rb_mKernel, rb_intern("autoload"), 2, 
+                   rb_str_new2(conv->name), rb_str_new2(conv->library));
+#else
+        plruby_define_void_class(conv->name, conv->library);
+#endif
+    }
 #endif
 }
 
-static void pl_result_mark(VALUE obj) {}
+/* returned by pl_protect, the Datum is in plth->retval */
+static VALUE pl_result_done;
 
 static VALUE
 pl_protect(plth)
     struct pl_thread_st *plth;
 {
     Datum retval;
-    VALUE result;
 
 #ifdef PG_PL_TRYCATCH
     PG_TRY();
@@ -372,8 +504,8 @@ pl_protect(plth)
     }
     PG_END_TRY();
 #endif
-    result = Data_Wrap_Struct(rb_cObject, pl_result_mark, 0, (void *)retval);
-    return result;
+    plth->retval = retval;
+    return pl_result_done;
 }
 
 #ifdef PLRUBY_TIMEOUT
@@ -508,7 +640,57 @@ pl_real_handler(struct pl_thread_st *plth)
 
 static void pl_init_all _(());
 
-MemoryContext plruby_spi_context;
+/* nesting level of the function running, see plruby_create_args */
+int
+plruby_call_level()
+{
+    return pl_call_level;
+}
+
+static MemoryContext pl_spi_context;
+static int pl_spi_connected = 0;
+
+/*
+ * SPI is only connected when a function uses it : a call which never
+ * runs a query doesn't pay for SPI_connect()/SPI_finish()
+ */
+void
+plruby_spi_connect()
+{
+    MemoryContext orig_context;
+    int rc;
+
+    if (pl_spi_connected) {
+        return;
+    }
+    PLRUBY_BEGIN_PROTECT(1);
+    orig_context = CurrentMemoryContext;
+    if ((rc = SPI_connect()) != SPI_OK_CONNECT) {
+        elog(ERROR, "cannot connect to SPI manager : %d", rc);
+    }
+    pl_spi_context = MemoryContextSwitchTo(orig_context);
+    PLRUBY_END_PROTECT;
+    pl_spi_connected = 1;
+}
+
+void
+plruby_spi_finish()
+{
+    MemoryContext oldcxt;
+    int rc;
+
+    if (!pl_spi_connected) {
+        return;
+    }
+    pl_spi_connected = 0;
+    PLRUBY_BEGIN_PROTECT(1);
+    oldcxt = MemoryContextSwitchTo(pl_spi_context);
+    if ((rc = SPI_finish()) != SPI_OK_FINISH) {
+        elog(ERROR, "SPI_finish() failed : %d", rc);
+    }
+    MemoryContextSwitchTo(oldcxt);
+    PLRUBY_END_PROTECT;
+}
 
 
 Datum
@@ -519,8 +701,8 @@ pl_internal_call_handler(struct pl_thread_st *plth)
     sigjmp_buf save_restart;
 #endif
     volatile VALUE *tmp;
-    MemoryContext orig_context;
     volatile VALUE orig_id;
+    int spi_connected;
 
     if (pl_firstcall) {
         pl_init_all();
@@ -530,18 +712,10 @@ pl_internal_call_handler(struct pl_thread_st *plth)
         Init_stack((VALUE *)&tmp);
     }
 
-    orig_context = CurrentMemoryContext;
     orig_id = rb_thread_local_aref(rb_thread_current(), id_thr);
     rb_thread_local_aset(rb_thread_current(), id_thr, Qnil);
-    if (SPI_connect() != SPI_OK_CONNECT) {
-        if (pl_call_level) {
-            rb_raise(pl_ePLruby, "cannot connect to SPI manager");
-        }
-        else {
-            elog(ERROR, "cannot connect to SPI manager");
-        }
-    }
-    plruby_spi_context =  MemoryContextSwitchTo(orig_context);
+    spi_connected = pl_spi_connected;
+    pl_spi_connected = 0;
 
 #ifndef PG_PL_TRYCATCH
     memcpy(&save_restart, &Warn_restart, sizeof(save_restart));
@@ -615,6 +789,7 @@ pl_internal_call_handler(struct pl_thread_st *plth)
 #endif
 
     rb_thread_local_aset(rb_thread_current(), id_thr, orig_id);
+    pl_spi_connected = spi_connected;
 
     if (result == pl_eCatch) {
         if (pl_call_level) {
@@ -638,9 +813,8 @@ pl_internal_call_handler(struct pl_thread_st *plth)
                  (int)RSTRING_LEN(result), RSTRING_PTR(result));
         }
     }
-    if (TYPE(result) == T_DATA && 
-        RDATA(result)->dmark == (RUBY_DATA_FUNC)pl_result_mark) {
-        return ((Datum)DATA_PTR(result));
+    if (result == pl_result_done) {
+        return plth->retval;
     }
     if (pl_call_level) {
         rb_raise(pl_ePLruby, "Invalid return value %d", TYPE(result));
@@ -693,7 +867,19 @@ pl_validator_handler(struct pl_thread_st *plth)
     }
     ReleaseSysCache(tuple);
     if (check_function_bodies) {
-	pl_compile(plth, istrigger);
+	struct pl_thread_st plth_valid;
+	FunctionCallInfoData fcinfo_valid;
+	FmgrInfo flinfo_valid;
+
+	/* compile the new function, not the validator */
+	MemSet(&fcinfo_valid, 0, sizeof(fcinfo_valid));
+	MemSet(&flinfo_valid, 0, sizeof(flinfo_valid));
+	flinfo_valid.fn_oid = funcoid;
+	flinfo_valid.fn_mcxt = CurrentMemoryContext;
+	fcinfo_valid.flinfo = &flinfo_valid;
+	plth_valid = *plth;
+	plth_valid.fcinfo = &fcinfo_valid;
+	pl_compile(&plth_valid, istrigger);
     }
     PG_RETURN_VOID();
 }
@@ -713,6 +899,243 @@ PLRUBY_CALL_HANDLER(PG_FUNCTION_ARGS)
 
 static char *definition = "def PLtemp.%s(%s)\n%s\nend";
 
+#if defined(PLRUBY_ISEQ_CACHE)
+static char *proc_definition = "Module.new do\ndef %s(%s)\n%s\nend\nend";
+#elif defined(RUBY_CAN_BIND_ANY)
+static char *proc_definition = "def %s(%s)\n%s\nend";
+#else
+#define proc_definition definition
+#endif
+
+struct pl_define_st {
+    char *name;
+    char *def;
+#ifdef PLRUBY_ISEQ_CACHE
+    Oid fn_oid;
+#endif
+};
+
+#ifdef PLRUBY_ISEQ_CACHE
+
+#define PLRUBY_ISEQ_DIR "plruby_iseq"
+
+/*
+ * Compiled bodies are kept in $PGDATA/plruby_iseq/<database oid>, one
+ * file <function oid>.iseq for each function. The source is stored with
+ * the bytecode as extra data : a file which doesn't match is compiled
+ * again and replaced. The files of the functions dropped, and the
+ * directories of the databases dropped, are removed by the next backend
+ * which sees it. This is only a cache, I/O errors are silently ignored.
+ */
+static void
+pl_iseq_path(char *path, Oid db_oid, Oid fn_oid)
+{
+    if (OidIsValid(fn_oid)) {
+        snprintf(path, MAXPGPATH, "%s/%u/%u.iseq", PLRUBY_ISEQ_DIR,
+                 db_oid, fn_oid);
+    }
+    else {
+        snprintf(path, MAXPGPATH, "%s/%u", PLRUBY_ISEQ_DIR, db_oid);
+    }
+}
+
+static VALUE
+pl_iseq_read(char *path)
+{
+    struct stat st;
+    VALUE bin;
+    FILE *f;
+    size_t len;
+
+    if (stat(path, &st) != 0 || st.st_size <= 0) {
+        return Qnil;
+    }
+    bin = rb_str_new(0, st.st_size);
+    if ((f = fopen(path, "rb")) == NULL) {
+        return Qnil;
+    }
+    len = fread(RSTRING_PTR(bin), 1, st.st_size, f);
+    fclose(f);
+    if (len != (size_t)st.st_size) {
+        return Qnil;
+    }
+    return bin;
+}
+
+static void
+pl_iseq_write(char *path, VALUE bin)
+{
+    char tmp[MAXPGPATH];
+    FILE *f;
+    int ok;
+
+    mkdir(PLRUBY_ISEQ_DIR, S_IRWXU);
+    pl_iseq_path(tmp, MyDatabaseId, InvalidOid);
+    mkdir(tmp, S_IRWXU);
+    snprintf(tmp, MAXPGPATH, "%s.%d", path, MyProcPid);
+    if ((f = fopen(tmp, "wb")) == NULL) {
+        return;
+    }
+    ok = fwrite(RSTRING_PTR(bin), 1, RSTRING_LEN(bin), f) == RSTRING_LEN(bin);
+    if (fclose(f) != 0 || !ok || rename(tmp, path) != 0) {
+        unlink(tmp);
+    }
+}
+
+/* remove the files of the functions used by this backend and dropped */
+static int
+pl_iseq_i_prune(VALUE key, VALUE value, VALUE arg)
+{
+    char path[MAXPGPATH];
+    Oid fn_oid = NUM2UINT(key);
+    int exists;
+
+    PLRUBY_BEGIN_PROTECT(1);
+    exists = SearchSysCacheExists(PROCOID, OidGD(fn_oid), 0, 0, 0);
+    PLRUBY_END_PROTECT;
+    if (exists) {
+        return ST_CONTINUE;
+    }
+    pl_iseq_path(path, MyDatabaseId, fn_oid);
+    unlink(path);
+    return ST_DELETE;
+}
+
+/* remove the directories of the databases dropped, once per backend */
+static void
+pl_iseq_prune_databases()
+{
+#if PG_PL_VERSION >= 90
+    char path[MAXPGPATH];
+    struct dirent *de, *fe;
+    DIR *dir, *sub;
+    Oid db_oid;
+    int exists;
+
+    if ((dir = opendir(PLRUBY_ISEQ_DIR)) == NULL) {
+        return;
+    }
+    while ((de = readdir(dir)) != NULL) {
+        if (de->d_name[0] == '.' ||
+            (db_oid = (Oid)strtoul(de->d_name, NULL, 10)) == MyDatabaseId) {
+            continue;
+        }
+        PLRUBY_BEGIN_PROTECT(1);
+        exists = SearchSysCacheExists(DATABASEOID, OidGD(db_oid), 0, 0, 0);
+        PLRUBY_END_PROTECT;
+        if (exists) {
+            continue;
+        }
+        pl_iseq_path(path, db_oid, InvalidOid);
+        if ((sub = opendir(path)) != NULL) {
+            while ((fe = readdir(sub)) != NULL) {
+                if (fe->d_name[0] != '.') {
+                    snprintf(path, MAXPGPATH, "%s/%s/%s", PLRUBY_ISEQ_DIR,
+                             de->d_name, fe->d_name);
+                    unlink(path);
+                }
+            }
+            closedir(sub);
+            pl_iseq_path(path, db_oid, InvalidOid);
+        }
+        rmdir(path);
+    }
+    closedir(dir);
+#endif
+}
+
+static void
+pl_iseq_prune()
+{
+    if (!pl_iseq_checked) {
+        pl_iseq_checked = 1;
+        pl_iseq_prune_databases();
+    }
+    if (pl_iseq_stale) {
+        pl_iseq_stale = 0;
+        rb_hash_foreach(pl_iseq_oids, pl_iseq_i_prune, Qnil);
+    }
+}
+
+static VALUE
+pl_iseq_i_load(VALUE arg)
+{
+    VALUE *args = (VALUE *)arg;
+
+    if (!RTEST(rb_str_equal(rb_funcall(pl_cISeq, id_extra_data, 1, args[0]),
+                            args[1]))) {
+        return Qnil;
+    }
+    return rb_funcall(pl_cISeq, id_load_from_binary, 1, args[0]);
+}
+
+static VALUE
+pl_iseq_fetch(struct pl_define_st *pld)
+{
+    char path[MAXPGPATH];
+    VALUE args[2], iseq;
+    int status;
+
+    pl_iseq_path(path, MyDatabaseId, pld->fn_oid);
+    rb_hash_aset(pl_iseq_oids, UINT2NUM(pld->fn_oid), Qtrue);
+    args[1] = rb_str_new2(pld->def);
+    args[0] = pl_iseq_read(path);
+    if (!NIL_P(args[0])) {
+        iseq = rb_protect(pl_iseq_i_load, (VALUE)args, &status);
+        if (status) {
+            rb_set_errinfo(Qnil);
+        }
+        else if (!NIL_P(iseq)) {
+            return iseq;
+        }
+    }
+    iseq = rb_funcall(pl_cISeq, id_compile, 1, args[1]);
+    pl_iseq_write(path, rb_funcall(iseq, id_to_binary, 1, args[1]));
+    return iseq;
+}
+
+#endif
+
+/*
+ * Compile the body and return a Method bound to PLtemp. When methods
+ * of a module can be bound to any object, the body is defined in its
+ * own anonymous module so that PLtemp's method table is never touched.
+ */
+static VALUE
+pl_i_define(VALUE arg)
+{
+    struct pl_define_st *pld = (struct pl_define_st *)arg;
+    VALUE name = ID2SYM(rb_intern(pld->name));
+#if defined(PLRUBY_ISEQ_CACHE)
+    VALUE module = rb_funcall(pl_iseq_fetch(pld), id_eval, 0);
+
+    return rb_funcall(rb_funcall(module, id_instance_method, 1, name),
+                      id_bind, 1, pl_mPLtemp);
+#elif defined(RUBY_CAN_BIND_ANY)
+    VALUE module = rb_module_new();
+
+    if (MAIN_SAFE_LEVEL >= 3) {
+        rb_obj_taint(module);
+    }
+    rb_funcall(module, id_module_eval, 1, rb_str_new2(pld->def));
+    return rb_funcall(rb_funcall(module, id_instance_method, 1, name),
+                      id_bind, 1, pl_mPLtemp);
+#else
+    rb_eval_string(pld->def);
+    return rb_obj_method(pl_mPLtemp, name);
+#endif
+}
+
+VALUE
+plruby_proc_call(pl_proc_desc *prodesc, int argc, VALUE *argv)
+{
+#ifdef HAVE_RB_METHOD_CALL
+    return rb_method_call(argc, argv, prodesc->method);
+#else
+    return rb_funcall2(prodesc->method, id_call, argc, argv);
+#endif
+}
+
 #if PG_PL_VERSION >= 82
 
 static VALUE
@@ -821,7 +1244,7 @@ pl_compile(struct pl_thread_st *plth, int istrigger)
     VALUE value_proc_desc;
     VALUE value_proname;
     Oid result_oid, arg_type[FUNC_MAX_ARGS];
-    int nargs = 0;
+    int nargs = 0, polymorphic = 0, validating;
     static char *argt = "new, old, args, tg";
     PG_FUNCTION_ARGS;
     
@@ -833,8 +1256,6 @@ pl_compile(struct pl_thread_st *plth, int istrigger)
 	sprintf(internal_proname, "proc_%u", fcinfo->flinfo->fn_oid);
     }
     proname_len = strlen(internal_proname);
-    value_proname = rb_tainted_str_new(internal_proname, proname_len);
-    value_proc_desc = rb_hash_aref(PLruby_hash, value_proname);
 
     PLRUBY_BEGIN(1);
     procTup = SearchSysCache(PROCOID, OidGD(fcinfo->flinfo->fn_oid), 0, 0, 0);
@@ -849,6 +1270,7 @@ pl_compile(struct pl_thread_st *plth, int istrigger)
 	if (procStruct->prorettype == ANYARRAYOID ||
 	    procStruct->prorettype == ANYELEMENTOID) {
 	    result_oid = get_fn_expr_rettype(fcinfo->flinfo);
+	    polymorphic = 1;
 	    if (result_oid == InvalidOid) {
 		result_oid = procStruct->prorettype;
 	    }
@@ -866,6 +1288,7 @@ pl_compile(struct pl_thread_st *plth, int istrigger)
 	    if (procStruct->proargtypes.values[i] == ANYARRAYOID ||
 		procStruct->proargtypes.values[i] == ANYELEMENTOID) {
 		arg_type[i] = get_fn_expr_argtype(fcinfo->flinfo, i);
+		polymorphic = 1;
 		if (arg_type[i] == InvalidOid) {
 		    arg_type[i] = procStruct->proargtypes.values[i];
 		}
@@ -874,6 +1297,7 @@ pl_compile(struct pl_thread_st *plth, int istrigger)
 	    if (procStruct->proargtypes[i] == ANYARRAYOID ||
 		procStruct->proargtypes[i] == ANYELEMENTOID) {
 		arg_type[i] = get_fn_expr_argtype(fcinfo->flinfo, i);
+		polymorphic = 1;
 		if (arg_type[i] == InvalidOid) {
 		    arg_type[i] = procStruct->proargtypes[i];
 		}
@@ -891,6 +1315,28 @@ pl_compile(struct pl_thread_st *plth, int istrigger)
 	}
     }
 
+    /*
+     * a polymorphic function has one descriptor for each set of
+     * resolved types, so that alternating callers don't recompile it
+     */
+    value_proname = rb_tainted_str_new(internal_proname, proname_len);
+    if (polymorphic) {
+	char buf[16];
+
+	sprintf(buf, "_%u", result_oid);
+	rb_str_cat2(value_proname, buf);
+	for (i = 0; i < nargs; ++i) {
+	    sprintf(buf, "_%u", arg_type[i]);
+	    rb_str_cat2(value_proname, buf);
+	}
+    }
+    /*
+     * polymorphic types are only resolved at call time, the validator
+     * just compiles the body
+     */
+    validating = plth->validator && polymorphic;
+    value_proc_desc = rb_hash_aref(PLruby_hash, value_proname);
+
     if (!NIL_P(value_proc_desc)) {
         int uptodate;
 
@@ -916,8 +1362,10 @@ pl_compile(struct pl_thread_st *plth, int istrigger)
 	}
 #endif
         if (!uptodate) {
-            rb_remove_method(pl_sPLtemp, internal_proname);
             value_proc_desc = Qnil;
+#if PG_PL_VERSION >= 75
+            pl_proc_generation++;
+#endif
         }
     }
 
@@ -925,22 +1373,25 @@ pl_compile(struct pl_thread_st *plth, int istrigger)
         HeapTuple typeTup;
         Form_pg_type typeStruct;
         char *proc_source, *proc_internal_def;
+        struct pl_define_st pld;
         int status;
         MemoryContext oldcontext;
 
-        value_proc_desc = Data_Make_Struct(rb_cObject, pl_proc_desc, 0, pl_proc_free, prodesc);
+        value_proc_desc = Data_Make_Struct(rb_cObject, pl_proc_desc, pl_proc_mark,
+                                           pl_proc_free, prodesc);
 	if (!istrigger) {
 	    prodesc->result_oid = result_oid;
+	    prodesc->nargs = nargs;
 	}
         PLRUBY_BEGIN(1);
         oldcontext = MemoryContextSwitchTo(TopMemoryContext);
         prodesc->fn_xmin = HeapTupleHeaderGetXmin(procTup->t_data);
         prodesc->fn_cmin = HeapTupleHeaderGetCmin(procTup->t_data);
-	if (!istrigger) {
+	if (!istrigger && !validating) {
 	    typeTup = SearchSysCache(TYPEOID, OidGD(result_oid), 0, 0, 0);
 	}
         PLRUBY_END;
-	if (!istrigger) {
+	if (!istrigger && !validating) {
 	    if (!HeapTupleIsValid(typeTup)) {
 		rb_raise(pl_ePLruby, "cache lookup for return type failed");
 	    }
@@ -1022,11 +1473,13 @@ pl_compile(struct pl_thread_st *plth, int istrigger)
 	    else {
 		fmgr_info(typeStruct->typinput, &(prodesc->result_func));
 		prodesc->result_len = typeStruct->typlen;
+		if (!prodesc->result_type || prodesc->result_type == 'b') {
+		    prodesc->result_conv = plruby_result_converter(result_oid);
+		}
 	    }
 	    PLRUBY_END;
 	    ReleaseSysCache(typeTup);
 
-	    prodesc->nargs = nargs;
 	    for (i = 0; i < prodesc->nargs; i++)    {
 
 		PLRUBY_BEGIN(1);
@@ -1072,6 +1525,7 @@ pl_compile(struct pl_thread_st *plth, int istrigger)
 		else {
 		    fmgr_info(typeStruct->typoutput, &(prodesc->arg_func[i]));
 		    prodesc->arg_len[i] = typeStruct->typlen;
+		    prodesc->arg_conv[i] = plruby_arg_converter(arg_type[i]);
 		}
 		ReleaseSysCache(typeTup);
 		PLRUBY_END;
@@ -1099,23 +1553,28 @@ pl_compile(struct pl_thread_st *plth, int istrigger)
             PLRUBY_BEGIN_PROTECT(1);
             proc_source = DatumGetCString(DFC1(textout, prosrc));
 	    if (istrigger) {
-		proc_internal_def = ALLOCA_N(char, strlen(definition) + proname_len +
+		proc_internal_def = ALLOCA_N(char, strlen(proc_definition) + proname_len +
 					     strlen(argt) + strlen(proc_source) + 1);
-		sprintf(proc_internal_def, definition, internal_proname, 
+		sprintf(proc_internal_def, proc_definition, internal_proname, 
 			argt, proc_source);
 	    }
 	    else {
-		proc_internal_def = ALLOCA_N(char, strlen(definition) + 
+		proc_internal_def = ALLOCA_N(char, strlen(proc_definition) + 
 					     proname_len + RSTRING_LEN(argname) +
 					     strlen(proc_source) + 1);
-		sprintf(proc_internal_def, definition, internal_proname,
+		sprintf(proc_internal_def, proc_definition, internal_proname,
 			RSTRING_PTR(argname), proc_source);
 	    }
             pfree(proc_source);
             PLRUBY_END_PROTECT;
         }
 
-        rb_eval_string_protect(proc_internal_def, &status);
+        pld.name = internal_proname;
+        pld.def = proc_internal_def;
+#ifdef PLRUBY_ISEQ_CACHE
+        pld.fn_oid = fcinfo->flinfo->fn_oid;
+#endif
+        prodesc->method = rb_protect(pl_i_define, (VALUE)&pld, &status);
         if (status) {
             VALUE s = plruby_to_s(rb_gv_get("$!"));
             rb_hash_delete(PLruby_hash, value_proname);
@@ -1124,7 +1583,9 @@ pl_compile(struct pl_thread_st *plth, int istrigger)
         }
         prodesc->proname = ALLOC_N(char, strlen(internal_proname) + 1);
         strcpy(prodesc->proname, internal_proname);
-        rb_hash_aset(PLruby_hash, value_proname, value_proc_desc); 
+        if (!validating) {
+            rb_hash_aset(PLruby_hash, value_proname, value_proc_desc); 
+        }
         PLRUBY_BEGIN(1);
         MemoryContextSwitchTo(oldcontext);
         PLRUBY_END;
@@ -1133,21 +1594,62 @@ pl_compile(struct pl_thread_st *plth, int istrigger)
     return value_proname;
 }
 
-static Datum
-pl_func_handler(struct pl_thread_st *plth)
+static VALUE
+pl_proc_lookup(struct pl_thread_st *plth, int istrigger,
+               pl_proc_desc **prodesc)
 {
-    VALUE value_proc_desc, ary;
-    VALUE value_proname;
-    pl_proc_desc *prodesc;
-
-    value_proname = pl_compile(plth, 0);
+    VALUE value_proc_desc, value_proname;
+    FmgrInfo *flinfo = plth->fcinfo->flinfo;
+#if PG_PL_VERSION >= 75
+    struct pl_fn_extra *extra;
+
+    /* fn_extra belongs to funcapi for functions returning a set */
+    extra = NULL;
+    if (!flinfo->fn_retset) {
+        extra = (struct pl_fn_extra *)flinfo->fn_extra;
+        if (extra && extra->generation == pl_proc_generation) {
+            *prodesc = extra->prodesc;
+            return extra->value_proc_desc;
+        }
+    }
+#endif
+#ifdef PLRUBY_ISEQ_CACHE
+    pl_iseq_prune();
+#endif
+    value_proname = pl_compile(plth, istrigger);
     value_proc_desc = rb_hash_aref(PLruby_hash, value_proname);
     if (NIL_P(value_proc_desc)) {
 	rb_raise(pl_ePLruby, "cannot create internal procedure");
     }
-    GetProcDesc(value_proc_desc, prodesc);
+    GetProcDesc(value_proc_desc, *prodesc);
+#if PG_PL_VERSION >= 75
+    if (!flinfo->fn_retset) {
+        if (!extra) {
+            PLRUBY_BEGIN_PROTECT(1);
+            extra = (struct pl_fn_extra *)
+                MemoryContextAlloc(flinfo->fn_mcxt, sizeof(struct pl_fn_extra));
+            PLRUBY_END_PROTECT;
+            extra->out = NULL;
+            flinfo->fn_extra = (void *)extra;
+        }
+        extra->generation = pl_proc_generation;
+        extra->value_proc_desc = value_proc_desc;
+        extra->prodesc = *prodesc;
+    }
+#endif
+    return value_proc_desc;
+}
+
+static Datum
+pl_func_handler(struct pl_thread_st *plth)
+{
+    VALUE ary;
+    volatile VALUE value_proc_desc;
+    pl_proc_desc *prodesc;
+
+    value_proc_desc = pl_proc_lookup(plth, 0, &prodesc);
     ary = plruby_create_args(plth, prodesc);
-    return plruby_return_value(plth, prodesc, value_proname, ary);
+    return plruby_return_value(plth, value_proc_desc, prodesc, ary);
 }
 
 struct foreach_fmgr {
@@ -1246,19 +1748,17 @@ pl_trigger_handler(struct pl_thread_st *plth)
     char *stroid;
     HeapTuple rettup;
     TupleDesc tupdesc;
-    int i, rc;
+    int i;
     int *modattrs;
     Datum *modvalues;
     char *modnulls;
     VALUE tg_new, tg_old, args, TG, c, tmp;
-    VALUE value_proname, value_proc_desc;
+    VALUE argv[4];
+    volatile VALUE value_proc_desc;
+    pl_proc_desc *prodesc;
     PG_FUNCTION_ARGS;
 
-    value_proname = pl_compile(plth, 1);
-    value_proc_desc = rb_hash_aref(PLruby_hash, value_proname);
-    if (NIL_P(value_proc_desc)) {
-	rb_raise(pl_ePLruby, "cannot create internal procedure");
-    }
+    value_proc_desc = pl_proc_lookup(plth, 1, &prodesc);
     fcinfo = plth->fcinfo;
     trigdata = (TriggerData *) fcinfo->context;
     tupdesc = trigdata->tg_relation->rd_att;
@@ -1352,15 +1852,13 @@ pl_trigger_handler(struct pl_thread_st *plth)
     }
     rb_ary_freeze(args);
 
-    c = rb_funcall(pl_mPLtemp, rb_intern(RSTRING_PTR(value_proname)),
-                   4, tg_new, tg_old, args, TG);
+    argv[0] = tg_new;
+    argv[1] = tg_old;
+    argv[2] = args;
+    argv[3] = TG;
+    c = plruby_proc_call(prodesc, 4, argv);
 
-    PLRUBY_BEGIN_PROTECT(1);
-    MemoryContextSwitchTo(plruby_spi_context);
-    if ((rc = SPI_finish()) != SPI_OK_FINISH) {
-        elog(ERROR, "SPI_finish() failed : %d",  rc);
-    }
-    PLRUBY_END_PROTECT;
+    plruby_spi_finish();
 
     switch (TYPE(c)) {
     case T_TRUE:
@@ -1502,6 +2000,7 @@ pl_load_singleton(argc, argv, obj)
     buff = ALLOCA_N(char, 1 + strlen(recherche) + strlen(nom));
     sprintf(buff, recherche, nom);
 
+    plruby_spi_connect();
     PLRUBY_BEGIN_PROTECT(1);
     spi_rc = SPI_exec(buff, 0);
     PLRUBY_END_PROTECT;
@@ -1572,18 +2071,54 @@ static VALUE plans;
 extern void Init_plruby_pl();
 extern void Init_plruby_trans();
 
+static int pl_ruby_ready = 0;
+
+#if PG_PL_VERSION >= 84
+
+static int pl_ruby_pid;
+static char *pl_preload_libraries = NULL;
+
+static VALUE
+pl_i_preload(VALUE name)
+{
+    return rb_require(RSTRING_PTR(name));
+}
+
 static void
-pl_init_all(void)
+pl_preload()
 {
-    VALUE pl_mPL;
+    VALUE libs, name;
+    int i, status;
 
-    if (pl_fatal) {
-        elog(ERROR, "initialization not possible");
-    }
-    if (!pl_firstcall) {
+    if (pl_preload_libraries == NULL || !*pl_preload_libraries) {
         return;
     }
-    pl_fatal = 1;
+    libs = rb_funcall(rb_str_new2(pl_preload_libraries), rb_intern("split"),
+                      1, rb_str_new2(","));
+    for (i = 0; i < RARRAY_LEN(libs); ++i) {
+        name = rb_funcall(RARRAY_PTR(libs)[i], rb_intern("strip"), 0);
+        if (!RSTRING_LEN(name)) {
+            continue;
+        }
+        rb_protect(pl_i_preload, name, &status);
+        if (status) {
+            elog(ERROR, "plruby.preload_libraries : can't load %s",
+                 RSTRING_PTR(name));
+        }
+    }
+}
+
+#endif
+
+/*
+ * boot the interpreter : nothing here needs a database, this is also
+ * called in the postmaster when plruby is in shared_preload_libraries
+ */
+static void
+pl_init_ruby(void)
+{
+    VALUE pl_mPL;
+
     ruby_init();
 #if PLRUBY_ENABLE_CONVERSION || MAIN_SAFE_LEVEL < 3
     ruby_init_loadpath();
@@ -1643,12 +2178,27 @@ pl_init_all(void)
     pl_ePLruby = rb_const_get(pl_mPL, rb_intern("Error"));
     pl_eCatch = rb_const_get(pl_mPL, rb_intern("Catch"));
     pl_mPLtemp = rb_const_get(rb_cObject, rb_intern("PLtemp"));
-    pl_sPLtemp = rb_singleton_class(pl_mPLtemp);
     id_raise = rb_intern("raise");
     id_kill = rb_intern("kill");
     id_alive = rb_intern("alive?");
     id_value = rb_intern("value");
     id_call = rb_intern("call");
+#ifdef RUBY_CAN_BIND_ANY
+    id_module_eval = rb_intern("module_eval");
+    id_instance_method = rb_intern("instance_method");
+    id_bind = rb_intern("bind");
+#endif
+#ifdef PLRUBY_ISEQ_CACHE
+    id_compile = rb_intern("compile");
+    id_to_binary = rb_intern("to_binary");
+    id_load_from_binary = rb_intern("load_from_binary");
+    id_extra_data = rb_intern("load_from_binary_extra_data");
+    id_eval = rb_intern("eval");
+    pl_cISeq = rb_path2class("RubyVM::InstructionSequence");
+    rb_global_variable(&pl_cISeq);
+    pl_iseq_oids = rb_hash_new();
+    rb_global_variable(&pl_iseq_oids);
+#endif
     id_thr = rb_intern("__functype__");
 #ifdef PLRUBY_TIMEOUT
     rb_funcall(rb_thread_main(), rb_intern("priority="), 1, INT2NUM(10));
@@ -1656,12 +2206,45 @@ pl_init_all(void)
     rb_undef_method(CLASS_OF(rb_cThread), "start"); 
     rb_undef_method(CLASS_OF(rb_cThread), "fork"); 
     rb_undef_method(CLASS_OF(rb_cThread), "critical="); 
+#endif
+#if PG_PL_VERSION >= 84
+    pl_preload();
+    pl_ruby_pid = MyProcPid;
 #endif
     rb_set_safe_level(MAIN_SAFE_LEVEL);
     PLruby_hash = rb_hash_new();
     rb_global_variable(&PLruby_hash);
+    pl_result_done = rb_obj_alloc(rb_cObject);
+    rb_global_variable(&pl_result_done);
     plans = rb_hash_new();
     rb_define_variable("$Plans", &plans);
+    pl_ruby_ready = 1;
+}
+
+static void
+pl_init_all(void)
+{
+    if (pl_fatal) {
+        elog(ERROR, "initialization not possible");
+    }
+    if (!pl_firstcall) {
+        return;
+    }
+    pl_fatal = 1;
+    if (!pl_ruby_ready) {
+        pl_init_ruby();
+    }
+#if PG_PL_VERSION >= 84 && defined(HAVE_RB_THREAD_ATFORK)
+    else if (pl_ruby_pid != MyProcPid) {
+        /* the interpreter was booted in the postmaster */
+        rb_thread_atfork();
+        pl_ruby_pid = MyProcPid;
+    }
+#endif
+#if PG_PL_VERSION >= 75
+    CacheRegisterSyscacheCallback(PROCOID, pl_proc_inval, (Datum)0);
+    CacheRegisterSyscacheCallback(TYPEOID, pl_proc_inval, (Datum)0);
+#endif
     if (SPI_connect() != SPI_OK_CONNECT) {
         elog(ERROR, "plruby_singleton_methods : SPI_connect failed");
     }
@@ -1674,3 +2257,27 @@ pl_init_all(void)
     pl_fatal = pl_firstcall = 0;
     return;
 }
+
+#if PG_PL_VERSION >= 84
+
+void
+_PG_init(void)
+{
+#if PG_PL_VERSION >= 91
+    DefineCustomStringVariable("plruby.preload_libraries",
+                               "Ruby libraries loaded at startup.",
+                               NULL, &pl_preload_libraries, "",
+                               PGC_POSTMASTER, 0, NULL, NULL, NULL);
+#else
+    DefineCustomStringVariable("plruby.preload_libraries",
+                               "Ruby libraries loaded at startup.",
+                               NULL, &pl_preload_libraries, "",
+                               PGC_POSTMASTER, 0, NULL, NULL);
+#endif
+    /* backends forked by the postmaster inherit a ready interpreter */
+    if (process_shared_preload_libraries_in_progress && !pl_ruby_ready) {
+        pl_init_ruby();
+    }
+}
+
+#endif
@@ -28,6 +28,7 @@
 #if PG_PL_VERSION >= 75
 #include "nodes/pg_list.h"
 #include "utils/typcache.h"
+#include "utils/inval.h"
 #include "access/xact.h"
 #endif
 
@@ -35,6 +36,15 @@
 #include "utils/memutils.h"
 #endif
 
+#if PG_PL_VERSION >= 84
+#include "miscadmin.h"
+#include "utils/guc.h"
+#endif
+
+#if PG_PL_VERSION >= 90
+#include "parser/parse_param.h"
+#endif
+
 #include "package.h"
 
 #include <ruby.h>
@@ -204,11 +214,17 @@ struct pl_thread_st {
     PG_FUNCTION_ARGS;
     int timeout;
     Oid validator;
+    Datum retval;
 };
 
+typedef VALUE (*plruby_arg_conv) _((Datum));
+typedef int (*plruby_result_conv) _((VALUE, Datum *));
+
 typedef struct pl_proc_desc
 {
     char	   *proname;
+    VALUE	method;
+    VALUE	args;
     TransactionId  fn_xmin;
     CommandId      fn_cmin;
     FmgrInfo	result_func;
@@ -219,6 +235,7 @@ typedef struct pl_proc_desc
     bool	result_val;
     bool 	result_is_setof;
     char	result_align;
+    plruby_result_conv result_conv;
     int		nargs;
 #if PG_PL_VERSION >= 75
     int         named_args;
@@ -231,9 +248,27 @@ typedef struct pl_proc_desc
     bool	arg_val[FUNC_MAX_ARGS];
     char	arg_align[FUNC_MAX_ARGS];
     int		arg_is_rel[FUNC_MAX_ARGS];
+    plruby_arg_conv arg_conv[FUNC_MAX_ARGS];
     char result_type;
 } pl_proc_desc;
 
+#if PG_PL_VERSION >= 75
+
+/*
+ * Descriptor pinned on flinfo->fn_extra. It is valid as long as
+ * no pg_proc or pg_type entry was invalidated and no descriptor was
+ * replaced in PLruby_hash since it was stored. out holds the column
+ * conversions of the returned rows (see pl_tuple_heap)
+ */
+struct pl_fn_extra {
+    unsigned long generation;
+    VALUE value_proc_desc;
+    pl_proc_desc *prodesc;
+    void *out;
+};
+
+#endif
+
 struct portal_options {
     VALUE argsv;
     int count, output;
@@ -253,6 +288,10 @@ typedef struct pl_query_desc
     bool       *arg_val;
     char       *arg_align;
     int cursor;
+    void *cache;
+    Datum *argvalues;
+    char *argnulls;
+    int argbusy;
     struct portal_options po;
 } pl_query_desc;
 
@@ -265,6 +304,16 @@ struct PLportal {
     struct portal_options po;
 };
 
+#if PG_PL_VERSION == 74
+#define PORTAL_ACTIVE(port) ((port)->portalActive)
+#elif WITH_GREENPLUM == 1
+#define  PORTAL_ACTIVE(port) ((port)->portal_status == PORTAL_ACTIVE)
+#elif PG_PL_VERSION > 74
+#define  PORTAL_ACTIVE(port) ((port)->status == PORTAL_ACTIVE)
+#else
+#define PORTAL_ACTIVE(port) 0
+#endif
+
 #define GetPortal(obj, portal) do {			\
     Data_Get_Struct(obj, struct PLportal, portal);	\
     if (!portal->portal) {				\
@@ -284,19 +333,45 @@ struct PLportal {
 #define RET_DESC      4
 #define RET_DESC_ARR 12
 #define RET_BASIC    16
+#define RET_SYMBOL   32
+#define RET_COLUMNS  64
+#define RET_PACKED  128
+
+#if PG_PL_VERSION >= 82
+#define PL_ARR_NULLBITMAP(a) ARR_NULLBITMAP(a)
+#else
+#define PL_ARR_NULLBITMAP(a) ((bits8 *)NULL)
+#endif
 
 extern VALUE plruby_s_new _((int, VALUE *, VALUE));
 extern VALUE plruby_build_tuple _((HeapTuple, TupleDesc, int));
+extern VALUE plruby_tuple_meta _((TupleDesc));
+extern VALUE plruby_build_tuple_meta _((HeapTuple, VALUE, int));
+extern VALUE plruby_build_columns _((SPITupleTable *, int, int));
+extern int plruby_call_arg _((int, Datum *, Oid *));
+extern VALUE plruby_convert_arg _((Datum, Oid, FmgrInfo *, Oid, int));
+extern VALUE plruby_vector_new _((Datum, Oid));
+extern Oid plruby_vector_elemtype _((VALUE));
+extern VALUE plruby_array_view_new _((Datum));
+extern Datum plruby_vector_datum _((VALUE, Oid));
 extern Datum plruby_to_datum _((VALUE, FmgrInfo *, Oid, Oid, int));
-extern Datum plruby_return_value _((struct pl_thread_st *,  pl_proc_desc *,
-                                    VALUE, VALUE));
+extern Datum plruby_return_value _((struct pl_thread_st *, VALUE,
+                                    pl_proc_desc *, VALUE));
+extern VALUE plruby_proc_call _((pl_proc_desc *, int, VALUE *));
 extern VALUE plruby_create_args _((struct pl_thread_st *, pl_proc_desc *));
 extern VALUE plruby_i_each _((VALUE, struct portal_options *));
 extern void plruby_exec_output _((VALUE, int, int *));
 extern VALUE plruby_to_s _((VALUE));
+extern plruby_arg_conv plruby_arg_converter _((Oid));
+extern plruby_result_conv plruby_result_converter _((Oid));
 
 extern Datum plruby_return_array _((VALUE, pl_proc_desc *));
-extern MemoryContext plruby_spi_context;
+extern void *plruby_plan_cached _((char *, int, Oid *, void **));
+extern void plruby_plan_release _((void *));
+extern void plruby_plan_types _((char *, int, Oid *));
+extern void plruby_spi_connect _((void));
+extern void plruby_spi_finish _((void));
+extern int plruby_call_level _((void));
 
 extern Datum plruby_dfc0 _((PGFunction));
 extern Datum plruby_dfc1 _((PGFunction, Datum));
@@ -309,6 +384,7 @@ extern Oid plruby_datum_oid _((VALUE, int *));
 extern VALUE plruby_datum_set _((VALUE, Datum));
 extern Datum plruby_datum_get _((VALUE, Oid *));
 extern VALUE plruby_define_void_class _((char *, char *));
+extern VALUE plruby_conversion_class _((Oid));
 #endif
 
 #define DFC1(a_, b_) DirectFunctionCall1((a_), (b_))
@@ -236,6 +236,7 @@ pl_transaction(VALUE obj)
     }
     res = Data_Make_Struct(pl_cTrans, struct pl_trans, pl_trans_mark, 0, trans);
     trans->name = Qnil;
+    plruby_spi_connect();
     PLRUBY_BEGIN_PROTECT(1);
     if (IsSubTransaction()) {
         char name[1024];
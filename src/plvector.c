@@ -0,0 +1,645 @@
+#include "plruby.h"
+
+/*
+ * PL::Vector : a packed int4, int8, float4 or float8 buffer, read from
+ * an array argument, a "packed_columns" string or a ruby Array, with
+ * the reductions written in C
+ */
+
+static VALUE pl_ePLruby, pl_cVector;
+
+struct pl_vector {
+    Oid typoid;
+    int size;
+    long len;
+    char *ptr;
+};
+
+static struct pl_vector_type {
+    char *name;
+    Oid typoid;
+    int size;
+} pl_vector_types[] = {
+    { "int4", INT4OID, sizeof(int32) },
+    { "int8", INT8OID, sizeof(int64) },
+    { "float4", FLOAT4OID, sizeof(float4) },
+    { "float8", FLOAT8OID, sizeof(float8) },
+    { NULL, InvalidOid, 0 }
+};
+
+static void
+pl_vector_mark(struct pl_vector *vec)
+{
+}
+
+static void
+pl_vector_free(struct pl_vector *vec)
+{
+    xfree(vec->ptr);
+    xfree(vec);
+}
+
+#define GetVector(obj_, vec_) do {                                      \
+    if (TYPE(obj_) != T_DATA ||                                         \
+        RDATA(obj_)->dmark != (RUBY_DATA_FUNC)pl_vector_mark) {         \
+        rb_raise(rb_eArgError, "expected a PL::Vector");                \
+    }                                                                   \
+    Data_Get_Struct(obj_, struct pl_vector, vec_);                      \
+} while (0)
+
+static struct pl_vector_type *
+pl_vector_type(Oid typoid)
+{
+    struct pl_vector_type *vt;
+
+    for (vt = pl_vector_types; vt->name; vt++) {
+        if (vt->typoid == typoid) {
+            return vt;
+        }
+    }
+    return NULL;
+}
+
+static VALUE
+pl_vector_s_alloc(VALUE obj)
+{
+    struct pl_vector *vec;
+    VALUE res;
+
+    res = Data_Make_Struct(obj, struct pl_vector, pl_vector_mark,
+                           pl_vector_free, vec);
+    vec->typoid = InvalidOid;
+    return res;
+}
+
+static void
+pl_vector_set(struct pl_vector *vec, struct pl_vector_type *vt, long len)
+{
+    xfree(vec->ptr);
+    vec->ptr = NULL;
+    vec->typoid = vt->typoid;
+    vec->size = vt->size;
+    vec->len = len;
+    vec->ptr = ALLOC_N(char, len * vt->size + 1);
+}
+
+VALUE
+plruby_vector_new(Datum value, Oid typoid)
+{
+    struct pl_vector_type *vt;
+    struct pl_vector *vec;
+    ArrayType *array;
+    VALUE res;
+    long len;
+
+    PLRUBY_BEGIN_PROTECT(1);
+    array = DatumGetArrayTypeP(value);
+    PLRUBY_END_PROTECT;
+    if (!(vt = pl_vector_type(ARR_ELEMTYPE(array)))) {
+        rb_raise(pl_ePLruby, "PL::Vector : invalid element type %ld",
+                 OidGD(ARR_ELEMTYPE(array)));
+    }
+#if PG_PL_VERSION >= 82
+    if (ARR_HASNULL(array)) {
+        rb_raise(pl_ePLruby, "PL::Vector : array with NULL elements");
+    }
+#endif
+    len = ArrayGetNItems(ARR_NDIM(array), ARR_DIMS(array));
+    res = pl_vector_s_alloc(pl_cVector);
+    Data_Get_Struct(res, struct pl_vector, vec);
+    pl_vector_set(vec, vt, len);
+    memcpy(vec->ptr, ARR_DATA_PTR(array), len * vt->size);
+    OBJ_TAINT(res);
+    return res;
+}
+
+/* element type of a PL::Vector, InvalidOid for any other object */
+Oid
+plruby_vector_elemtype(VALUE obj)
+{
+    struct pl_vector *vec;
+
+    if (TYPE(obj) != T_DATA ||
+        RDATA(obj)->dmark != (RUBY_DATA_FUNC)pl_vector_mark) {
+        return InvalidOid;
+    }
+    Data_Get_Struct(obj, struct pl_vector, vec);
+    return vec->typoid;
+}
+
+Datum
+plruby_vector_datum(VALUE obj, Oid elemtype)
+{
+    struct pl_vector *vec;
+    ArrayType *array;
+    int nbytes;
+    int16 typlen;
+    bool typbyval;
+    char typalign;
+
+    GetVector(obj, vec);
+    if (vec->typoid != elemtype) {
+        rb_raise(pl_ePLruby, "PL::Vector : invalid element type for the array");
+    }
+    PLRUBY_BEGIN_PROTECT(1);
+    if (!vec->len) {
+        get_typlenbyvalalign(vec->typoid, &typlen, &typbyval, &typalign);
+        array = construct_array(NULL, 0, vec->typoid, typlen, typbyval,
+                                typalign);
+    }
+    else {
+#if PG_PL_VERSION >= 82
+        nbytes = ARR_OVERHEAD_NONULLS(1) + vec->len * vec->size;
+#else
+        nbytes = ARR_OVERHEAD(1) + vec->len * vec->size;
+#endif
+        array = (ArrayType *) palloc0(nbytes);
+#if PG_PL_VERSION >= 83
+        SET_VARSIZE(array, nbytes);
+#else
+        array->size = nbytes;
+#endif
+        array->ndim = 1;
+#if PG_PL_VERSION >= 82
+        array->dataoffset = 0;
+#endif
+        array->elemtype = vec->typoid;
+        ARR_DIMS(array)[0] = vec->len;
+        ARR_LBOUND(array)[0] = 1;
+        memcpy(ARR_DATA_PTR(array), vec->ptr, vec->len * vec->size);
+    }
+    PLRUBY_END_PROTECT;
+    return PointerGD(array);
+}
+
+/* a vector holding a copy of the array argument at position n */
+static VALUE
+pl_vector_s_arg(VALUE obj, VALUE a)
+{
+    Datum value;
+    Oid typoid;
+
+    if (!plruby_call_arg(NUM2INT(a), &value, &typoid)) {
+        return Qnil;
+    }
+    return plruby_vector_new(value, typoid);
+}
+
+static VALUE
+pl_vector_init(VALUE obj, VALUE a, VALUE b)
+{
+    struct pl_vector_type *vt;
+    struct pl_vector *vec;
+    long i;
+
+    GetVector(obj, vec);
+    a = plruby_to_s(a);
+    for (vt = pl_vector_types; vt->name; vt++) {
+        if (strcmp(RSTRING_PTR(a), vt->name) == 0) {
+            break;
+        }
+    }
+    if (!vt->name) {
+        rb_raise(pl_ePLruby, "PL::Vector : invalid type %s", RSTRING_PTR(a));
+    }
+    if (TYPE(b) == T_STRING) {
+        if (RSTRING_LEN(b) % vt->size) {
+            rb_raise(pl_ePLruby, "PL::Vector : string size not a multiple of %d",
+                     vt->size);
+        }
+        pl_vector_set(vec, vt, RSTRING_LEN(b) / vt->size);
+        memcpy(vec->ptr, RSTRING_PTR(b), RSTRING_LEN(b));
+    }
+    else {
+        b = rb_Array(b);
+        pl_vector_set(vec, vt, RARRAY_LEN(b));
+        for (i = 0; i < vec->len; i++) {
+            VALUE v = RARRAY_PTR(b)[i];
+
+            switch (vec->typoid) {
+            case INT4OID:
+                ((int32 *)vec->ptr)[i] = NUM2INT(v);
+                break;
+            case INT8OID:
+                ((int64 *)vec->ptr)[i] = NUM2LL(v);
+                break;
+            case FLOAT4OID:
+                ((float4 *)vec->ptr)[i] = NUM2DBL(v);
+                break;
+            case FLOAT8OID:
+                ((float8 *)vec->ptr)[i] = NUM2DBL(v);
+                break;
+            }
+        }
+    }
+    if (OBJ_TAINTED(b)) {
+        OBJ_TAINT(obj);
+    }
+    return obj;
+}
+
+static VALUE
+pl_vector_elem(struct pl_vector *vec, long i)
+{
+    switch (vec->typoid) {
+    case INT4OID:
+        return INT2NUM(((int32 *)vec->ptr)[i]);
+    case INT8OID:
+        return LL2NUM(((int64 *)vec->ptr)[i]);
+    case FLOAT4OID:
+        return rb_float_new(((float4 *)vec->ptr)[i]);
+    case FLOAT8OID:
+        return rb_float_new(((float8 *)vec->ptr)[i]);
+    }
+    return Qnil;
+}
+
+static VALUE
+pl_vector_size(VALUE obj)
+{
+    struct pl_vector *vec;
+
+    GetVector(obj, vec);
+    return LONG2NUM(vec->len);
+}
+
+static VALUE
+pl_vector_type_name(VALUE obj)
+{
+    struct pl_vector *vec;
+    struct pl_vector_type *vt;
+
+    GetVector(obj, vec);
+    if (!(vt = pl_vector_type(vec->typoid))) {
+        return Qnil;
+    }
+    return rb_str_new2(vt->name);
+}
+
+static VALUE
+pl_vector_aref(VALUE obj, VALUE a)
+{
+    struct pl_vector *vec;
+    long i;
+
+    GetVector(obj, vec);
+    i = NUM2LONG(a);
+    if (i < 0) {
+        i += vec->len;
+    }
+    if (i < 0 || i >= vec->len) {
+        return Qnil;
+    }
+    return pl_vector_elem(vec, i);
+}
+
+static VALUE
+pl_vector_to_a(VALUE obj)
+{
+    struct pl_vector *vec;
+    VALUE res;
+    long i;
+
+    GetVector(obj, vec);
+    res = rb_ary_new2(vec->len);
+    for (i = 0; i < vec->len; i++) {
+        rb_ary_push(res, pl_vector_elem(vec, i));
+    }
+    return res;
+}
+
+static VALUE
+pl_vector_to_s(VALUE obj)
+{
+    struct pl_vector *vec;
+
+    GetVector(obj, vec);
+    return rb_tainted_str_new(vec->ptr, vec->len * vec->size);
+}
+
+/*
+ * The kernels are plain loops over the typed buffer, without a call
+ * or a branch on the type inside. The int8 sums and the integer dot
+ * products check for an overflow, and go on with ruby Integers after it
+ */
+
+static int
+pl_int64_add(int64 a, int64 b, int64 *res)
+{
+#if defined(__GNUC__) && __GNUC__ >= 5 || defined(__clang__)
+    return __builtin_add_overflow(a, b, res);
+#else
+    if ((b > 0 && a > INT64CONST(0x7FFFFFFFFFFFFFFF) - b) ||
+        (b < 0 && a < -INT64CONST(0x7FFFFFFFFFFFFFFF) - 1 - b)) {
+        return 1;
+    }
+    *res = a + b;
+    return 0;
+#endif
+}
+
+static int
+pl_int64_mul(int64 a, int64 b, int64 *res)
+{
+#if defined(__GNUC__) && __GNUC__ >= 5 || defined(__clang__)
+    return __builtin_mul_overflow(a, b, res);
+#else
+    int64 r;
+
+    if (a == 0 || b == 0) {
+        *res = 0;
+        return 0;
+    }
+    if ((a == -1 && b == -INT64CONST(0x7FFFFFFFFFFFFFFF) - 1) ||
+        (b == -1 && a == -INT64CONST(0x7FFFFFFFFFFFFFFF) - 1)) {
+        return 1;
+    }
+    r = (int64)((uint64)a * (uint64)b);
+    if (r / b != a) {
+        return 1;
+    }
+    *res = r;
+    return 0;
+#endif
+}
+
+/* the rest of a sum, from the element i, with ruby Integers */
+static VALUE
+pl_vector_big_sum(struct pl_vector *vec, long i, VALUE acc)
+{
+    for (; i < vec->len; i++) {
+        acc = rb_funcall(acc, '+', 1, pl_vector_elem(vec, i));
+    }
+    return acc;
+}
+
+/* the rest of a dot product, from the element i, with ruby Integers */
+static VALUE
+pl_vector_big_dot(struct pl_vector *vec, struct pl_vector *other, long i,
+                  VALUE acc)
+{
+    VALUE prod;
+
+    for (; i < vec->len; i++) {
+        prod = rb_funcall(pl_vector_elem(vec, i), '*', 1,
+                          pl_vector_elem(other, i));
+        acc = rb_funcall(acc, '+', 1, prod);
+    }
+    return acc;
+}
+
+#define PL_VECTOR_SUM(type_, acc_, res_) do {                           \
+    type_ *p_ = (type_ *)vec->ptr;                                      \
+    acc_ s_ = 0;                                                        \
+    for (i = 0; i < vec->len; i++) {                                    \
+        s_ += p_[i];                                                    \
+    }                                                                   \
+    res_ = s_;                                                          \
+} while (0)
+
+static VALUE
+pl_vector_sum(VALUE obj)
+{
+    struct pl_vector *vec;
+    int64 isum = 0;
+    double fsum = 0;
+    long i;
+
+    GetVector(obj, vec);
+    switch (vec->typoid) {
+    case INT4OID:
+        PL_VECTOR_SUM(int32, int64, isum);
+        return LL2NUM(isum);
+    case INT8OID:
+    {
+        int64 *p = (int64 *)vec->ptr, s;
+
+        for (i = 0; i < vec->len; i++) {
+            if (pl_int64_add(isum, p[i], &s)) {
+                return pl_vector_big_sum(vec, i, LL2NUM(isum));
+            }
+            isum = s;
+        }
+        return LL2NUM(isum);
+    }
+    case FLOAT4OID:
+        PL_VECTOR_SUM(float4, double, fsum);
+        break;
+    case FLOAT8OID:
+        PL_VECTOR_SUM(float8, double, fsum);
+        break;
+    }
+    return rb_float_new(fsum);
+}
+
+static VALUE
+pl_vector_mean(VALUE obj)
+{
+    struct pl_vector *vec;
+
+    GetVector(obj, vec);
+    if (!vec->len) {
+        return Qnil;
+    }
+    return rb_float_new(NUM2DBL(pl_vector_sum(obj)) / vec->len);
+}
+
+#define PL_VECTOR_MINMAX(type_, op_) do {                               \
+    type_ *p_ = (type_ *)vec->ptr;                                      \
+    for (i = 1; i < vec->len; i++) {                                    \
+        idx = (p_[i] op_ p_[idx]) ? i : idx;                            \
+    }                                                                   \
+} while (0)
+
+static VALUE
+pl_vector_minmax(VALUE obj, int max)
+{
+    struct pl_vector *vec;
+    long i, idx = 0;
+
+    GetVector(obj, vec);
+    if (!vec->len) {
+        return Qnil;
+    }
+    switch (vec->typoid) {
+    case INT4OID:
+        if (max) PL_VECTOR_MINMAX(int32, >);
+        else PL_VECTOR_MINMAX(int32, <);
+        break;
+    case INT8OID:
+        if (max) PL_VECTOR_MINMAX(int64, >);
+        else PL_VECTOR_MINMAX(int64, <);
+        break;
+    case FLOAT4OID:
+        if (max) PL_VECTOR_MINMAX(float4, >);
+        else PL_VECTOR_MINMAX(float4, <);
+        break;
+    case FLOAT8OID:
+        if (max) PL_VECTOR_MINMAX(float8, >);
+        else PL_VECTOR_MINMAX(float8, <);
+        break;
+    }
+    return pl_vector_elem(vec, idx);
+}
+
+static VALUE
+pl_vector_min(VALUE obj)
+{
+    return pl_vector_minmax(obj, 0);
+}
+
+static VALUE
+pl_vector_max(VALUE obj)
+{
+    return pl_vector_minmax(obj, 1);
+}
+
+#define PL_VECTOR_DOT(type_, acc_, res_) do {                           \
+    type_ *p_ = (type_ *)vec->ptr, *q_ = (type_ *)other->ptr;           \
+    acc_ s_ = 0;                                                        \
+    for (i = 0; i < vec->len; i++) {                                    \
+        s_ += (acc_)p_[i] * q_[i];                                      \
+    }                                                                   \
+    res_ = s_;                                                          \
+} while (0)
+
+/* an int32 product is exact in an int64, only the sum is checked */
+#define PL_VECTOR_IDOT(type_, mul_) do {                                \
+    type_ *p_ = (type_ *)vec->ptr, *q_ = (type_ *)other->ptr;           \
+    int64 m_, s_;                                                       \
+    for (i = 0; i < vec->len; i++) {                                    \
+        if (mul_((int64)p_[i], (int64)q_[i], &m_) ||                    \
+            pl_int64_add(isum, m_, &s_)) {                              \
+            return pl_vector_big_dot(vec, other, i, LL2NUM(isum));      \
+        }                                                               \
+        isum = s_;                                                      \
+    }                                                                   \
+} while (0)
+
+static int
+pl_int32_mul(int64 a, int64 b, int64 *res)
+{
+    *res = a * b;
+    return 0;
+}
+
+static VALUE
+pl_vector_dot(VALUE obj, VALUE a)
+{
+    struct pl_vector *vec, *other;
+    int64 isum = 0;
+    double fsum = 0;
+    long i;
+
+    GetVector(obj, vec);
+    GetVector(a, other);
+    if (vec->typoid != other->typoid || vec->len != other->len) {
+        rb_raise(pl_ePLruby, "PL::Vector#dot : vectors of different type or size");
+    }
+    switch (vec->typoid) {
+    case INT4OID:
+        PL_VECTOR_IDOT(int32, pl_int32_mul);
+        return LL2NUM(isum);
+    case INT8OID:
+        PL_VECTOR_IDOT(int64, pl_int64_mul);
+        return LL2NUM(isum);
+    case FLOAT4OID:
+        PL_VECTOR_DOT(float4, double, fsum);
+        break;
+    case FLOAT8OID:
+        PL_VECTOR_DOT(float8, double, fsum);
+        break;
+    }
+    return rb_float_new(fsum);
+}
+
+#define PL_VECTOR_HISTO(type_) do {                                     \
+    type_ *p_ = (type_ *)vec->ptr;                                      \
+    for (i = 0; i < vec->len; i++) {                                    \
+        double x_ = p_[i];                                              \
+        if (x_ >= lo && x_ <= hi) {                                     \
+            b = (long)((x_ - lo) * scale);                              \
+            count[b < nbins ? b : nbins - 1]++;                         \
+        }                                                               \
+    }                                                                   \
+} while (0)
+
+/* histogram(bins, min = self.min, max = self.max) : counts per bin */
+static VALUE
+pl_vector_histogram(int argc, VALUE *argv, VALUE obj)
+{
+    struct pl_vector *vec;
+    VALUE a, b_min, b_max, res;
+    double lo, hi, scale;
+    long i, b, nbins, *count;
+
+    GetVector(obj, vec);
+    rb_scan_args(argc, argv, "12", &a, &b_min, &b_max);
+    nbins = NUM2LONG(a);
+    if (nbins <= 0) {
+        rb_raise(pl_ePLruby, "PL::Vector#histogram : invalid number of bins");
+    }
+    if (NIL_P(b_min)) b_min = pl_vector_min(obj);
+    if (NIL_P(b_max)) b_max = pl_vector_max(obj);
+    res = rb_ary_new2(nbins);
+    if (NIL_P(b_min) || NIL_P(b_max)) {
+        for (i = 0; i < nbins; i++) {
+            rb_ary_push(res, INT2FIX(0));
+        }
+        return res;
+    }
+    lo = NUM2DBL(b_min);
+    hi = NUM2DBL(b_max);
+    scale = (hi > lo) ? nbins / (hi - lo) : 0;
+    count = ALLOC_N(long, nbins);
+    MEMZERO(count, long, nbins);
+    switch (vec->typoid) {
+    case INT4OID:
+        PL_VECTOR_HISTO(int32);
+        break;
+    case INT8OID:
+        PL_VECTOR_HISTO(int64);
+        break;
+    case FLOAT4OID:
+        PL_VECTOR_HISTO(float4);
+        break;
+    case FLOAT8OID:
+        PL_VECTOR_HISTO(float8);
+        break;
+    }
+    for (i = 0; i < nbins; i++) {
+        rb_ary_push(res, LONG2NUM(count[i]));
+    }
+    xfree(count);
+    return res;
+}
+
+void
+Init_plruby_vector()
+{
+    VALUE pl_mPL;
+
+    pl_mPL = rb_const_get(rb_cObject, rb_intern("PL"));
+    pl_ePLruby = rb_const_get(pl_mPL, rb_intern("Error"));
+    pl_cVector = rb_define_class_under(pl_mPL, "Vector", rb_cObject);
+#if HAVE_RB_DEFINE_ALLOC_FUNC
+    rb_define_alloc_func(pl_cVector, pl_vector_s_alloc);
+#else
+    rb_define_singleton_method(pl_cVector, "allocate", pl_vector_s_alloc, 0);
+#endif
+    rb_define_singleton_method(pl_cVector, "new", plruby_s_new, -1);
+    rb_define_singleton_method(pl_cVector, "arg", pl_vector_s_arg, 1);
+    rb_define_private_method(pl_cVector, "initialize", pl_vector_init, 2);
+    rb_define_method(pl_cVector, "size", pl_vector_size, 0);
+    rb_define_method(pl_cVector, "length", pl_vector_size, 0);
+    rb_define_method(pl_cVector, "type", pl_vector_type_name, 0);
+    rb_define_method(pl_cVector, "[]", pl_vector_aref, 1);
+    rb_define_method(pl_cVector, "to_a", pl_vector_to_a, 0);
+    rb_define_method(pl_cVector, "to_s", pl_vector_to_s, 0);
+    rb_define_method(pl_cVector, "sum", pl_vector_sum, 0);
+    rb_define_method(pl_cVector, "mean", pl_vector_mean, 0);
+    rb_define_method(pl_cVector, "min", pl_vector_min, 0);
+    rb_define_method(pl_cVector, "max", pl_vector_max, 0);
+    rb_define_method(pl_cVector, "dot", pl_vector_dot, 1);
+    rb_define_method(pl_cVector, "histogram", pl_vector_histogram, -1);
+}
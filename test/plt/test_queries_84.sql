@@ -0,0 +1,46 @@
+
+select poly_twice(21) as i, poly_twice('ab'::text) as t, poly_twice(1.5::float8) as f;
+
+select exec_symbols();
+
+select exec_columns('columns');
+select exec_columns('packed_columns');
+
+select vector_stats('{3,1,4,1,5}');
+select vector_scale('{1.5,-2,0.25}', 2);
+select vector_stats('{1,NULL}');
+select vector_big();
+
+select view_int4('{{1,NULL,3},{4,5,6}}');
+select view_text('{a,NULL,ccc,dd}');
+select view_bounds('{}');
+select view_bounds('{1,2}');
+select view_noindex('{{1,2},{3,4}}');
+
+select array_int4(1), array_int4(2), array_float8();
+select array_int4(3);
+
+select arow(i) from generate_series(1, 3) as i;
+
+select * from hash_rows(3);
+select * from hash_row();
+select * from hash_bad();
+
+select count(*), sum(x), min(x), max(x) from emit_series(2500) as x;
+select emit_series(3);
+select * from emit_hrows();
+
+select exec_stream(3);
+select exec_stream(2);
+select * from stream_rows();
+
+select exec_values();
+select exec_untyped();
+
+select plan_cache();
+
+select plan_args();
+
+select batch_insert();
+select batch_error();
+select * from T_batch order by i;
@@ -0,0 +1,5 @@
+
+select limit_series() limit 3;
+select limit_count();
+
+select exec_infer(), exec_infer();